@@ -2,6 +2,7 @@
 
 #include "math.hpp"
 #include <vector>
+#include <cmath>
 #include <vtkSmartPointer.h>
 #include <vtkSphereSource.h>
 #include <vtkPolyDataMapper.h>
@@ -20,18 +21,7 @@ public:
     /// Constructor: computes all five Lagrange points via Newton–Raphson.
     /// </summary>
     LagrangePoints() {
-        // Initial guesses along the x-axis for L1, L2, L3 and equilateral for L4/L5
-        std::vector<Vector2d> guesses = {
-            {0.8  , 0.0},          // L1 approx
-            {1.2 , 0.0},          // L2 approx
-            {-1.0, 0.0},         // L3 approx
-            {0.5, 0.8}, // L4
-            {0.5 , -0.8}  // L5
-        };
-
-        for (auto& x0 : guesses) {
-            lagrangePoints_.push_back(FindPoint(x0));
-        }
+        ComputePoints();
 
         // Setup shared geometry: one sphere source and mapper
         sphereSource_ = vtkSmartPointer<vtkSphereSource>::New();
@@ -69,6 +59,17 @@ public:
         }
     }
 
+    /// <summary>
+    /// Recomputes the Lagrange points for the system selected by CRTBP::SetSystem and moves the markers.
+    /// </summary>
+    void OnSystemChanged() {
+        ComputePoints();
+        for (int i = 0; i < 5; ++i) {
+            actors_[i]->SetPosition(lagrangePoints_[i].x(), lagrangePoints_[i].y(), 0.0);
+            labels_[i]->SetPosition(lagrangePoints_[i].x(), lagrangePoints_[i].y(), 0.05);
+        }
+    }
+
     /// <summary>
     /// Returns the computed Lagrange point positions.
     /// </summary>
@@ -82,16 +83,36 @@ private:
     std::vector<vtkSmartPointer<vtkBillboardTextActor3D>> labels_;
 
     /// <summary>
-    /// Newton–Raphson solver using CRTBP::PseudoPotentialGrad and Hessian.
+    /// Computes all five Lagrange points from initial guesses that scale with the mass ratio.
+    /// </summary>
+    void ComputePoints() {
+        // Hill radius approximation for L1/L2, first-order expansion for L3, exact equilateral points for L4/L5
+        double mu = CRTBP::Mu();
+        double hill = std::cbrt(mu / 3);
+        std::vector<Vector2d> guesses = {
+            {1 - mu - hill, 0.0},           // L1 approx
+            {1 - mu + hill, 0.0},           // L2 approx
+            {-1 - 5 * mu / 12, 0.0},        // L3 approx
+            {0.5 - mu, std::sqrt(3) / 2},   // L4
+            {0.5 - mu, -std::sqrt(3) / 2}   // L5
+        };
+
+        lagrangePoints_.clear();
+        for (auto& x0 : guesses) {
+            lagrangePoints_.push_back(FindPoint(x0));
+        }
+    }
+
+    /// <summary>
+    /// Newton–Raphson solver using the gradient and Hessian from CRTBP::EvalPotential.
     /// </summary>
     Vector2d FindPoint(const Vector2d& x0) {
         Vector2d x = x0;
         for (int iter = 0; iter < 10; ++iter) {
-            // Compute gradient and Hessian
-            Eigen::Vector2d v = CRTBP::PseudoPotentialGrad(x);
-            Eigen::Matrix2d H = CRTBP::PseudoPotentialHessian(x);
+            // Compute gradient and Hessian in one pass
+            CRTBP::PotentialSample sample = CRTBP::EvalPotential(x, 2);
             // Newton step: x_{n+1} = x_n - H^{-1} * v
-            Vector2d dx = H.lu().solve(v);
+            Vector2d dx = sample.hessian.lu().solve(sample.grad);
             x = x - dx;
             if (dx.norm() < 1e-8) break;
         }
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "math.hpp"
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+/// <summary>
+/// Candidate connection between a departing and an arriving section crossing.
+/// </summary>
+struct Connection
+{
+	size_t departing;	// index of the crossing of the unstable manifold
+	size_t arriving;	// index of the crossing of the stable manifold
+	double mismatch;	// scaled distance of the two crossings in (y, vy)
+};
+
+/// <summary>
+/// Uniform grid over points of a Poincare section in (y, vy). The points are bucketed by their grid cell with a
+/// counting sort into one flat array in row-major cell order, so a radius query only visits the 3x3 cells
+/// around the query point, and queries in cell order walk the array almost sequentially. The velocity axis is
+/// scaled before bucketing, so that the query radius applies to both axes. The cells grow beyond the requested
+/// size when the bounding box would need more than a few cells per point.
+/// </summary>
+class SectionGrid
+{
+public:
+	/// <summary>
+	/// Builds the grid. The cell size should be the query radius.
+	/// </summary>
+	/// <param name="points">Section coordinates (y, vy).</param>
+	/// <param name="cellSize">Edge length of the grid cells in scaled coordinates.</param>
+	/// <param name="velocityScale">Factor that is applied to vy.</param>
+	void Build(const std::vector<Vector2d>& points, double cellSize, double velocityScale = 1)
+	{
+		mVelocityScale = velocityScale;
+		size_t n = points.size();
+		mMin = Vector2d::Zero();
+		Vector2d max = Vector2d::Zero();
+		if (n > 0)
+		{
+			mMin = max = Scale(points[0]);
+			for (const Vector2d& p : points)
+			{
+				mMin = mMin.cwiseMin(Scale(p));
+				max = max.cwiseMax(Scale(p));
+			}
+		}
+		Vector2d extent = max - mMin;
+		mCellSize = std::max({ cellSize, std::sqrt(extent.x() * extent.y() / (MaxCellsPerPoint * std::max<size_t>(n, 1))),
+			std::max(extent.x(), extent.y()) / (MaxCellsPerPoint * std::max<size_t>(n, 1)), 1e-300 });
+		mSize = Vector2i((int)(extent.x() / mCellSize) + 1, (int)(extent.y() / mCellSize) + 1);
+		size_t buckets = (size_t)mSize.x() * mSize.y();
+
+		// bucket of each point, then a counting sort by bucket
+		std::vector<uint32_t> bucket(n);
+		ThreadPool::Shared().ParallelFor(0, n, 4096, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				bucket[i] = (uint32_t)Bucket(points[i]);
+		});
+		mStart.assign(buckets + 1, 0);
+		for (size_t i = 0; i < n; ++i) mStart[bucket[i] + 1]++;
+		for (size_t b = 0; b < buckets; ++b) mStart[b + 1] += mStart[b];
+		std::vector<uint32_t> next(mStart.begin(), mStart.end() - 1);
+		mIndex.resize(n);
+		mPoints.resize(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			uint32_t slot = next[bucket[i]]++;
+			mIndex[slot] = (uint32_t)i;
+			mPoints[slot] = Scale(points[i]);
+		}
+	}
+
+	/// <summary>
+	/// Calls f(index, distance) for every point within a radius of a query point. The radius must not exceed
+	/// the cell size.
+	/// </summary>
+	/// <param name="query">Section coordinates (y, vy) of the query point.</param>
+	/// <param name="radius">Largest scaled distance.</param>
+	/// <param name="f">Callback with the index of the point in the input of Build and its scaled distance.</param>
+	template<typename F>
+	void Query(const Vector2d& query, double radius, F&& f) const
+	{
+		if (mPoints.empty()) return;
+		Vector2d q = Scale(query);
+		Vector2d cell = ((q - mMin) / mCellSize).array().floor();
+		if (cell.x() < -1 || cell.y() < -1 || cell.x() > mSize.x() || cell.y() > mSize.y()) return;
+		int x0 = std::max((int)cell.x() - 1, 0), x1 = std::min((int)cell.x() + 1, mSize.x() - 1);
+		int y0 = std::max((int)cell.y() - 1, 0), y1 = std::min((int)cell.y() + 1, mSize.y() - 1);
+		for (int y = y0; y <= y1; ++y)
+		{
+			// the cells of a row are adjacent buckets
+			size_t row = (size_t)y * mSize.x();
+			for (uint32_t slot = mStart[row + x0]; slot < mStart[row + x1 + 1]; ++slot)
+			{
+				double distance = (mPoints[slot] - q).norm();
+				if (distance <= radius) f((size_t)mIndex[slot], distance);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Gets the bucket of a point in row-major cell order, points outside the grid are clamped to its border.
+	/// Sorting queries by their bucket makes consecutive queries visit nearby memory.
+	/// </summary>
+	size_t Bucket(const Vector2d& p) const
+	{
+		Vector2d cell = ((Scale(p) - mMin) / mCellSize).array().floor();
+		int x = (int)std::min(std::max(cell.x(), 0.0), mSize.x() - 1.0);
+		int y = (int)std::min(std::max(cell.y(), 0.0), mSize.y() - 1.0);
+		return (size_t)y * mSize.x() + x;
+	}
+
+	size_t Size() const { return mPoints.size(); }								// number of points in the grid
+	size_t NumBuckets() const { return (size_t)mSize.x() * mSize.y(); }		// number of grid cells
+
+private:
+	static constexpr double MaxCellsPerPoint = 4;	// the cells grow when the grid would have more cells per point
+
+	/// <summary>
+	/// Scales the velocity axis of section coordinates.
+	/// </summary>
+	Vector2d Scale(const Vector2d& p) const { return Vector2d(p.x(), p.y() * mVelocityScale); }
+
+	double mCellSize = 1;				// edge length of the grid cells in scaled coordinates
+	double mVelocityScale = 1;			// factor that is applied to vy
+	Vector2d mMin = Vector2d::Zero();	// lower corner of the grid in scaled coordinates
+	Vector2i mSize = Vector2i::Ones();	// number of cells along both axes
+	std::vector<uint32_t> mStart;		// first slot of each bucket, followed by the end of the last bucket
+	std::vector<uint32_t> mIndex;		// input index of the point in each slot
+	std::vector<Vector2d> mPoints;		// scaled coordinates of the point in each slot
+};
+
+/// <summary>
+/// Searches heteroclinic connection candidates: pairs of an unstable manifold crossing of one orbit and a
+/// stable manifold crossing of another orbit that nearly coincide on a shared section. The stable crossings
+/// are put into a SectionGrid, and the unstable crossings query it in batches on the thread pool.
+/// </summary>
+class ConnectionSearch
+{
+public:
+	/// <summary>
+	/// Settings of the search.
+	/// </summary>
+	struct Settings
+	{
+		double radius = 1e-3;			// largest mismatch of a candidate
+		double velocityScale = 1;		// weight of vy relative to y in the mismatch
+		size_t maxConnections = 1000;	// number of candidates that are returned
+		size_t batchSize = 1024;		// queries per task
+	};
+
+	/// <summary>
+	/// Finds the pairs of departing and arriving crossings within the search radius.
+	/// </summary>
+	/// <param name="departing">Section coordinates (y, vy) of the unstable manifold crossings.</param>
+	/// <param name="arriving">Section coordinates (y, vy) of the stable manifold crossings.</param>
+	/// <param name="settings">Settings of the search.</param>
+	/// <returns>At most maxConnections candidates, sorted by increasing mismatch.</returns>
+	static std::vector<Connection> Find(const std::vector<Vector2d>& departing, const std::vector<Vector2d>& arriving,
+		const Settings& settings)
+	{
+		SectionGrid grid;
+		grid.Build(arriving, settings.radius, settings.velocityScale);
+
+		// queries in bucket order by a counting sort, so that each batch covers a compact region of the grid
+		size_t n = departing.size();
+		std::vector<uint32_t> bucket(n);
+		ThreadPool::Shared().ParallelFor(0, n, 4096, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				bucket[i] = (uint32_t)grid.Bucket(departing[i]);
+		});
+		std::vector<uint32_t> start(grid.NumBuckets() + 1, 0), order(n);
+		for (size_t i = 0; i < n; ++i) start[bucket[i] + 1]++;
+		for (size_t b = 0; b + 1 < start.size(); ++b) start[b + 1] += start[b];
+		for (size_t i = 0; i < n; ++i) order[start[bucket[i]]++] = (uint32_t)i;
+
+		// once a batch has enough candidates, the radius of all later batches shrinks to the worst one it keeps
+		std::vector<Connection> connections;
+		std::mutex mutex;
+		std::atomic<double> shared{ settings.radius };
+		ThreadPool::Shared().ParallelFor(0, n, settings.batchSize, [&](size_t begin, size_t end)
+		{
+			std::vector<Connection> local;
+			double radius = shared;
+			for (size_t k = begin; k < end; ++k)
+			{
+				size_t i = order[k];
+				grid.Query(departing[i], radius, [&](size_t j, double distance) { local.push_back(Connection{ i, j, distance }); });
+				if (local.size() > 2 * settings.maxConnections)
+				{
+					radius = std::min(Keep(local, settings.maxConnections), radius);
+					double current = shared;
+					while (radius < current && !shared.compare_exchange_weak(current, radius)) {}
+				}
+			}
+			Keep(local, settings.maxConnections);
+			std::lock_guard<std::mutex> lock(mutex);
+			connections.insert(connections.end(), local.begin(), local.end());
+		});
+		Keep(connections, settings.maxConnections);
+		std::sort(connections.begin(), connections.end(), Less);
+		return connections;
+	}
+
+private:
+	/// <summary>
+	/// Orders candidates by mismatch, ties by index so that the result does not depend on the threads.
+	/// </summary>
+	static bool Less(const Connection& a, const Connection& b)
+	{
+		if (a.mismatch != b.mismatch) return a.mismatch < b.mismatch;
+		return a.departing != b.departing ? a.departing < b.departing : a.arriving < b.arriving;
+	}
+
+	/// <summary>
+	/// Keeps the candidates with the smallest mismatch.
+	/// </summary>
+	/// <returns>Mismatch of the best discarded candidate, infinity if none was discarded.</returns>
+	static double Keep(std::vector<Connection>& connections, size_t count)
+	{
+		if (connections.size() <= count) return std::numeric_limits<double>::infinity();
+		std::nth_element(connections.begin(), connections.begin() + count, connections.end(), Less);
+		double threshold = connections[count].mismatch;
+		connections.resize(count);
+		return threshold;
+	}
+};
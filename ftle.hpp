@@ -0,0 +1,325 @@
+#pragma once
+
+#include "ensemble.hpp"
+#include "refinement.hpp"
+#include "tracer.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkImageMapToColors.h>
+#include <vtkImageActor.h>
+#include <vtkImageMapper3D.h>
+#include <vtkLookupTable.h>
+#include <vtkTextActor.h>
+#include <vtkTextProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Finite-time Lyapunov exponent of the flow map of the tracer's launch conditions: every grid node is
+/// launched with Tracer::InitialState, i.e., at the tracer's Jacobi level, and the FTLE follows from the
+/// largest stretching of the end positions of neighboring nodes. The grid is processed in square blocks;
+/// a block integrates its nodes plus a one-node halo and only keeps the end positions, so the memory of a
+/// computation is proportional to the block size instead of the number of trajectories.
+/// </summary>
+class FTLEField
+{
+public:
+	/// <summary>
+	/// Settings of the FTLE grid.
+	/// </summary>
+	struct Settings
+	{
+		int resolution = 1024;			// number of nodes along x and y
+		double integrationTime = 2.0;	// integration time of the flow map
+		double stepSize = 0.005;		// RK4 step size
+		double xMin = -2.0, xMax = 2.0;	// domain of the grid, same as the Jacobi constant field
+		double yMin = -2.0, yMax = 2.0;
+	};
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	explicit FTLEField(const Settings& settings) : mSettings(settings) {}
+
+	const Settings& GetSettings() const { return mSettings; }
+
+	/// <summary>
+	/// Gets the position of a grid node.
+	/// </summary>
+	Vector2d Node(int i, int j) const
+	{
+		int n = mSettings.resolution - 1;
+		return Vector2d(mSettings.xMin + i * (mSettings.xMax - mSettings.xMin) / n, mSettings.yMin + j * (mSettings.yMax - mSettings.yMin) / n);
+	}
+
+	/// <summary>
+	/// Computes the FTLE of a block of grid nodes. The flow map gradient is approximated with central differences
+	/// between the neighboring nodes of the block, i.e., with a spacing of stride grid nodes, which is narrower
+	/// next to the last node of a block at the border of the grid (see ScalarBlock::NodeI).
+	/// Nodes in the forbidden region of the Jacobi level, or next to it, get NaN.
+	/// </summary>
+	/// <param name="i0">First node along x.</param>
+	/// <param name="j0">First node along y.</param>
+	/// <param name="ni">Number of nodes along x.</param>
+	/// <param name="nj">Number of nodes along y.</param>
+	/// <param name="stride">Distance between the nodes of the block in grid nodes.</param>
+	/// <returns>FTLE values of the block.</returns>
+	ScalarBlock ComputeBlock(int i0, int j0, int ni, int nj, int stride) const
+	{
+		ScalarBlock block;
+		block.i0 = i0; block.j0 = j0; block.ni = ni; block.nj = nj; block.stride = stride;
+		block.values.resize(ni * nj);
+
+		// grid indices of the nodes of the block and of a halo of one node around it
+		int res = mSettings.resolution;
+		int hw = ni + 2, hh = nj + 2;
+		std::vector<int> hi(hw), hj(hh);
+		for (int a = 0; a < hw; ++a)
+			hi[a] = a == 0 ? i0 - stride : a == hw - 1 ? block.NodeI(ni - 1, res) + stride : block.NodeI(a - 1, res);
+		for (int b = 0; b < hh; ++b)
+			hj[b] = b == 0 ? j0 - stride : b == hh - 1 ? block.NodeJ(nj - 1, res) + stride : block.NodeJ(b - 1, res);
+
+		// launch the nodes and the halo
+		std::vector<Vector4d> initial(hw * hh);
+		std::vector<bool> allowed(hw * hh);
+		for (int b = 0; b < hh; ++b)
+			for (int a = 0; a < hw; ++a)
+			{
+				Vector2d pos = Node(hi[a], hj[b]);
+				initial[b * hw + a] = Tracer::InitialState(pos);
+				allowed[b * hw + a] = 2 * CRTBP::PseudoPotential(pos) > Tracer::GetJacobiLevel();
+			}
+
+		// a single chunk keeps the integration on the calling thread, the blocks are the unit of parallelism
+		TerminationSettings termination;
+		termination.maxTime = mSettings.integrationTime;
+		int numSteps = (int)(mSettings.integrationTime / mSettings.stepSize + 0.5);
+		EnsembleIntegrator ensemble;
+		ensemble.SetStepSize(mSettings.stepSize);
+		ensemble.SetStepsPerSample(numSteps);
+		ensemble.SetChunkSize(initial.size());
+		ensemble.SetTermination(termination);
+		EnsembleResult result;
+		ensemble.Integrate(initial, result);
+
+		auto end = [&](int a, int b)
+		{
+			size_t k = b * hw + a;
+			size_t last = k * result.samplesPerTrajectory + result.numSamples[k] - 1;
+			return Vector2d(result.x[last], result.y[last]);
+		};
+
+		for (int b = 1; b <= nj; ++b)
+			for (int a = 1; a <= ni; ++a)
+			{
+				float& value = block.values[(b - 1) * ni + (a - 1)];
+				if (!allowed[b * hw + a] || !allowed[b * hw + a - 1] || !allowed[b * hw + a + 1] || !allowed[(b - 1) * hw + a] || !allowed[(b + 1) * hw + a])
+				{
+					value = std::numeric_limits<float>::quiet_NaN();
+					continue;
+				}
+				double hx = Node(hi[a + 1], 0).x() - Node(hi[a - 1], 0).x();
+				double hy = Node(0, hj[b + 1]).y() - Node(0, hj[b - 1]).y();
+				Vector2d dx = (end(a + 1, b) - end(a - 1, b)) / hx;
+				Vector2d dy = (end(a, b + 1) - end(a, b - 1)) / hy;
+				value = (float)Exponent(dx, dy);
+			}
+		return block;
+	}
+
+private:
+	/// <summary>
+	/// Computes the FTLE from the columns of the flow map gradient: ln of the square root of the largest
+	/// eigenvalue of the Cauchy-Green tensor, divided by the integration time.
+	/// </summary>
+	double Exponent(const Vector2d& dx, const Vector2d& dy) const
+	{
+		double c11 = dx.dot(dx), c12 = dx.dot(dy), c22 = dy.dot(dy);
+		double tr = c11 + c22, det = c11 * c22 - c12 * c12;
+		double lambda = 0.5 * (tr + std::sqrt(std::max(tr * tr - 4 * det, 0.0)));
+		return std::log(std::max(lambda, 1e-300)) / (2 * mSettings.integrationTime);
+	}
+
+	Settings mSettings;		// settings of the grid
+};
+
+/// <summary>
+/// Class that shows the FTLE field as a colored image layer below the reference grid. The field is computed
+/// progressively in the background: a coarse grid appears first and is refined around the ridges while the
+/// application runs; the blocks that finished are painted into the image in place once per frame.
+/// </summary>
+class FTLELayer
+{
+public:
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	FTLELayer()
+	{
+		mImageData = vtkSmartPointer<vtkImageData>::New();
+
+		mLookupTable = vtkSmartPointer<vtkLookupTable>::New();
+		mLookupTable->SetHueRange(0.66, 0.0);
+		mLookupTable->SetTableRange(0, 1);
+		mLookupTable->SetNanColor(0, 0, 0, 0);
+		mLookupTable->Build();
+
+		mColors = vtkSmartPointer<vtkImageMapToColors>::New();
+		mColors->SetLookupTable(mLookupTable);
+		mColors->SetOutputFormatToRGBA();
+		mColors->SetInputData(mImageData);
+
+		mActor = vtkSmartPointer<vtkImageActor>::New();
+		mActor->GetMapper()->SetInputConnection(mColors->GetOutputPort());
+		mActor->SetPosition(0, 0, -2E-2);
+		mActor->SetOpacity(0.85);
+		mActor->VisibilityOff();
+
+		mProgress = vtkSmartPointer<vtkTextActor>::New();
+		mProgress->GetTextProperty()->SetFontSize(14);
+		mProgress->GetTextProperty()->SetColor(0.8, 0.8, 0.8);
+		mProgress->SetDisplayPosition(10, 60);
+	}
+
+	/// <summary>
+	/// Destructor. Cancels the running computation.
+	/// </summary>
+	~FTLELayer() { Cancel(); }
+
+	/// <summary>
+	/// Adds the actors to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actors to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		renderer->AddActor(mActor);
+		renderer->AddActor2D(mProgress);
+	}
+
+	/// <summary>
+	/// Gets the field settings that are used by the next call to Start().
+	/// </summary>
+	FTLEField::Settings& GetSettings() { return mSettings; }
+
+	/// <summary>
+	/// Gets the refinement settings that are used by the next call to Start().
+	/// A coarse stride of 1 computes the full resolution in tiles of blockCells x blockCells cells.
+	/// </summary>
+	RefinementScheduler::Settings& GetRefinement() { return mRefinement; }
+
+	/// <summary>
+	/// Discards the current field and starts computing a new one in the background.
+	/// </summary>
+	void Start()
+	{
+		Cancel();
+		auto field = std::make_shared<FTLEField>(mSettings);
+		RefinementScheduler::Settings refinement = mRefinement;
+		refinement.resolution = mSettings.resolution;
+
+		int res = mSettings.resolution;
+		Vector2d p0 = field->Node(0, 0), p1 = field->Node(1, 1);
+		mImageData->SetDimensions(res, res, 1);
+		mImageData->SetOrigin(p0.x(), p0.y(), 0);
+		mImageData->SetSpacing(p1.x() - p0.x(), p1.y() - p0.y(), 1);
+		mImageData->AllocateScalars(VTK_FLOAT, 1);
+		float* pixels = static_cast<float*>(mImageData->GetScalarPointer());
+		std::fill(pixels, pixels + (size_t)res * res, std::numeric_limits<float>::quiet_NaN());
+		mImageData->Modified();
+		mSum = mSumSquares = 0;
+		mCount = 0;
+		mStart = std::chrono::steady_clock::now();
+		mActor->VisibilityOn();
+
+		mScheduler = std::make_unique<RefinementScheduler>(refinement, [field](int i0, int j0, int ni, int nj, int stride)
+		{
+			return field->ComputeBlock(i0, j0, ni, nj, stride);
+		});
+	}
+
+	/// <summary>
+	/// Stops the background computation.
+	/// </summary>
+	void Cancel()
+	{
+		if (mScheduler) mScheduler->Cancel();
+	}
+
+	/// <summary>
+	/// Computes the field on first use, afterwards toggles its visibility.
+	/// </summary>
+	void Toggle()
+	{
+		if (!mScheduler) Start();
+		else mActor->SetVisibility(!mActor->GetVisibility());
+	}
+
+	/// <summary>
+	/// Paints the blocks that finished since the last call into the image and updates the color range.
+	/// </summary>
+	void Update()
+	{
+		if (!mScheduler) return;
+
+		float* pixels = static_cast<float*>(mImageData->GetScalarPointer());
+		size_t painted = mScheduler->Paint(pixels, [this](const ScalarBlock& block)
+		{
+			for (float v : block.values)
+				if (std::isfinite(v)) { mSum += v; mSumSquares += (double)v * v; ++mCount; }
+		});
+		if (painted > 0)
+		{
+			mImageData->Modified();
+
+			// color range from the statistics of the computed nodes, clipping the spikes at the collision radii
+			if (mCount > 0)
+			{
+				double mean = mSum / mCount, sigma = std::sqrt(std::max(mSumSquares / mCount - mean * mean, 0.0));
+				mLookupTable->SetTableRange(std::max(0.0, mean - sigma), mean + 3 * sigma);
+			}
+		}
+
+		int res = mSettings.resolution;
+		std::string text = "FTLE " + std::to_string(res) + "x" + std::to_string(res) + ": stride " + std::to_string(mScheduler->FinestStride())
+			+ ", " + std::to_string(100 * mScheduler->ComputedNodes() / mScheduler->TotalNodes()) + "% of the nodes computed";
+		if (mScheduler->Done())
+			text += " in " + std::to_string(std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count()) + " s";
+		mProgress->SetInput(text.c_str());
+	}
+
+	/// <summary>
+	/// Recomputes a visible field for the selected CRTBP system, otherwise discards it.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		if (!mScheduler) return;
+		if (mActor->GetVisibility()) Start();
+		else { mScheduler.reset(); mProgress->SetInput(""); }
+	}
+
+private:
+	FTLELayer(const FTLELayer&) = delete;			// Delete the copy-constructor.
+	void operator=(const FTLELayer&) = delete;		// Delete the assignment operator.
+
+	FTLEField::Settings mSettings;						// field settings for the next computation
+	RefinementScheduler::Settings mRefinement;			// refinement settings for the next computation
+	std::unique_ptr<RefinementScheduler> mScheduler;	// running or last computation
+	std::chrono::steady_clock::time_point mStart;		// start time of the computation
+	double mSum = 0, mSumSquares = 0;					// statistics of the finite FTLE values for the color range
+	size_t mCount = 0;
+	vtkSmartPointer<vtkImageData> mImageData;			// FTLE values
+	vtkSmartPointer<vtkLookupTable> mLookupTable;		// color map
+	vtkSmartPointer<vtkImageMapToColors> mColors;		// maps the FTLE values to colors
+	vtkSmartPointer<vtkImageActor> mActor;				// actor of the colored image
+	vtkSmartPointer<vtkTextActor> mProgress;			// progress display
+};
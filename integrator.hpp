@@ -0,0 +1,514 @@
+#pragma once
+
+#include "crtbp.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/// <summary>
+/// Numerical schemes that can be used to integrate trajectories.
+/// </summary>
+enum class IntegratorType
+{
+	RK4,				// classic fourth-order Runge-Kutta with fixed step size
+	DormandPrince54		// embedded Runge-Kutta 5(4) with adaptive step size and dense output
+};
+
+/// <summary>
+/// Settings of a trajectory integration.
+/// </summary>
+struct IntegratorSettings
+{
+	IntegratorType type = IntegratorType::RK4;
+	double duration = 4.995;		// integration time, negative to integrate backwards
+	double stepSize = 0.005;		// fixed step size of RK4 and initial step size of Dormand-Prince
+	double outputInterval = 0.005;	// time between two emitted states of Dormand-Prince
+	double relTol = 1e-9;			// relative error tolerance per step of Dormand-Prince
+	double absTol = 1e-11;			// absolute error tolerance per step of Dormand-Prince
+	double minStep = 1e-10;			// smallest step size Dormand-Prince may shrink to
+	double maxStep = 0.1;			// largest step size Dormand-Prince may grow to
+};
+
+/// <summary>
+/// Reason why the integration of a trajectory stopped.
+/// </summary>
+enum class Termination : uint8_t
+{
+	Running,			// still being integrated
+	MaxTime,			// reached the maximum integration time
+	SunCollision,		// entered the radius of the Sun
+	EarthCollision,		// entered the radius of the Earth
+	Escape				// left the escape radius around the barycenter
+};
+
+/// <summary>
+/// Conditions that end the integration of a single trajectory. The defaults follow the CRTBP system that is
+/// selected when the settings are created: the collision radius of the Earth scales with its Hill radius
+/// (mu / 3)^(1/3), so that L1 and L2 stay outside of it in every system.
+/// </summary>
+struct TerminationSettings
+{
+	static constexpr double ReferenceMu = 0.02;			// mass ratio for which the Earth radius is ReferenceEarthRadius
+	static constexpr double ReferenceEarthRadius = 0.05;	// collision radius of the Earth at ReferenceMu
+
+	double sunRadius = 0.1;								// collision radius of the Sun (radius of the rendered sphere)
+	double earthRadius = EarthRadius(CRTBP::Mu());		// collision radius of the Earth (radius of the rendered sphere)
+	double escapeRadius = 3.0;							// distance from the barycenter at which a trajectory counts as escaped
+	double maxTime = 10.0;								// maximum integration time
+
+	/// <summary>
+	/// Collision radius of the Earth for a mass ratio, the same fraction of the Hill radius as at ReferenceMu.
+	/// </summary>
+	static double EarthRadius(double mu) { return ReferenceEarthRadius * std::cbrt(mu / ReferenceMu); }
+};
+
+/// <summary>
+/// Counters that are collected during an integration.
+/// </summary>
+struct IntegratorStats
+{
+	int steps = 0;			// accepted steps
+	int rejected = 0;		// rejected steps
+	int evaluations = 0;	// evaluations of the equations of motion
+};
+
+/// <summary>
+/// Dormand-Prince 5(4) stepper with error control and fourth-order continuous (dense) output.
+/// </summary>
+/// <typeparam name="Model">CRTBP model that provides Direction().</typeparam>
+template<typename Model>
+class DormandPrince54
+{
+public:
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	/// <param name="state">Initial state.</param>
+	/// <param name="t">Initial time.</param>
+	/// <param name="settings">Tolerances, step size limits and integration direction.</param>
+	DormandPrince54(const Vector4d& state, double t, const IntegratorSettings& settings) :
+		mSettings(settings), mT(t), mT0(t), mTEnd(t + settings.duration), mY(state), mY0(state), mK1(Model::Direction(state)),
+		mH(std::copysign(std::min(std::abs(settings.stepSize), settings.maxStep), settings.duration))
+	{
+		mStats.evaluations = 1;
+	}
+
+	/// <summary>
+	/// Advances by one accepted step, without passing the end of the integration.
+	/// The step size is adapted until the local error meets the tolerances.
+	/// </summary>
+	void Step()
+	{
+		const double dir = mH < 0 ? -1.0 : 1.0;
+		for (;;)
+		{
+			double h = mH;
+			if (dir * (mT + h - mTEnd) > 0) h = mTEnd - mT;
+
+			const Vector4d& k1 = mK1;
+			Vector4d k2 = Model::Direction(mY + h * (a21 * k1));
+			Vector4d k3 = Model::Direction(mY + h * (a31 * k1 + a32 * k2));
+			Vector4d k4 = Model::Direction(mY + h * (a41 * k1 + a42 * k2 + a43 * k3));
+			Vector4d k5 = Model::Direction(mY + h * (a51 * k1 + a52 * k2 + a53 * k3 + a54 * k4));
+			Vector4d k6 = Model::Direction(mY + h * (a61 * k1 + a62 * k2 + a63 * k3 + a64 * k4 + a65 * k5));
+			Vector4d y1 = mY + h * (a71 * k1 + a73 * k3 + a74 * k4 + a75 * k5 + a76 * k6);
+			Vector4d k7 = Model::Direction(y1);
+			mStats.evaluations += 6;
+
+			// scaled RMS norm of the difference between the fifth and fourth order solutions
+			Vector4d err = h * (e1 * k1 + e3 * k3 + e4 * k4 + e5 * k5 + e6 * k6 + e7 * k7);
+			double norm = 0;
+			for (int i = 0; i < 4; ++i)
+			{
+				double scale = mSettings.absTol + mSettings.relTol * std::max(std::abs(mY[i]), std::abs(y1[i]));
+				norm += (err[i] / scale) * (err[i] / scale);
+			}
+			norm = std::sqrt(norm / 4);
+
+			double factor = norm > 0 ? 0.9 * std::pow(norm, -0.2) : 10.0;
+			if (norm <= 1 || std::abs(h) <= mSettings.minStep)
+			{
+				// accept and prepare the dense output of this step
+				Vector4d ydiff = y1 - mY;
+				Vector4d bspl = h * k1 - ydiff;
+				mR[0] = mY;
+				mR[1] = ydiff;
+				mR[2] = bspl;
+				mR[3] = ydiff - h * k7 - bspl;
+				mR[4] = h * (d1 * k1 + d3 * k3 + d4 * k4 + d5 * k5 + d6 * k6 + d7 * k7);
+
+				mT0 = mT;
+				mY0 = mY;
+				mT += h;
+				mY = y1;
+				mK1 = k7;	// first same as last
+				mStats.steps++;
+
+				factor = std::min(factor, 10.0);
+				mH = dir * std::clamp(std::abs(mH) * factor, mSettings.minStep, mSettings.maxStep);
+				return;
+			}
+			mStats.rejected++;
+			mH = dir * std::max(std::abs(h) * std::max(factor, 0.2), mSettings.minStep);
+		}
+	}
+
+	/// <summary>
+	/// Evaluates the continuous extension of the last accepted step.
+	/// </summary>
+	/// <param name="t">Time inside the last accepted step.</param>
+	/// <returns>Interpolated state.</returns>
+	Vector4d DenseOutput(double t) const
+	{
+		if (mT == mT0) return mY;
+		double theta = (t - mT0) / (mT - mT0), theta1 = 1 - theta;
+		return mR[0] + theta * (mR[1] + theta1 * (mR[2] + theta * (mR[3] + theta1 * mR[4])));
+	}
+
+	bool Done() const { return mT == mTEnd; }				// true once the end of the integration is reached
+	double Time() const { return mT; }						// time at the end of the last accepted step
+	double PreviousTime() const { return mT0; }				// time at the start of the last accepted step
+	const Vector4d& State() const { return mY; }			// state at the end of the last accepted step
+	const Vector4d& PreviousState() const { return mY0; }	// state at the start of the last accepted step
+	const IntegratorStats& Stats() const { return mStats; }
+
+private:
+	// Butcher tableau
+	static constexpr double a21 = 1.0 / 5;
+	static constexpr double a31 = 3.0 / 40, a32 = 9.0 / 40;
+	static constexpr double a41 = 44.0 / 45, a42 = -56.0 / 15, a43 = 32.0 / 9;
+	static constexpr double a51 = 19372.0 / 6561, a52 = -25360.0 / 2187, a53 = 64448.0 / 6561, a54 = -212.0 / 729;
+	static constexpr double a61 = 9017.0 / 3168, a62 = -355.0 / 33, a63 = 46732.0 / 5247, a64 = 49.0 / 176, a65 = -5103.0 / 18656;
+	static constexpr double a71 = 35.0 / 384, a73 = 500.0 / 1113, a74 = 125.0 / 192, a75 = -2187.0 / 6784, a76 = 11.0 / 84;
+
+	// difference between the fifth and the embedded fourth order weights
+	static constexpr double e1 = 71.0 / 57600, e3 = -71.0 / 16695, e4 = 71.0 / 1920, e5 = -17253.0 / 339200, e6 = 22.0 / 525, e7 = -1.0 / 40;
+
+	// coefficients of the continuous extension (Hairer, Norsett, Wanner: Solving ODEs I)
+	static constexpr double d1 = -12715105075.0 / 11282082432, d3 = 87487479700.0 / 32700410799, d4 = -10690763975.0 / 1880347072;
+	static constexpr double d5 = 701980252875.0 / 199316789632, d6 = -1453857185.0 / 822651844, d7 = 69997945.0 / 29380423;
+
+	IntegratorSettings mSettings;
+	double mT, mT0;			// time at the end and the start of the last accepted step
+	double mTEnd;			// time at the end of the integration
+	Vector4d mY, mY0;		// state at the end and the start of the last accepted step
+	Vector4d mK1;			// derivative at the end of the last accepted step
+	Vector4d mR[5];			// coefficients of the dense output polynomial
+	double mH;				// proposed size of the next step
+	IntegratorStats mStats;
+};
+
+/// <summary>
+/// Classic fourth-order Runge-Kutta stepper with fixed step size and cubic Hermite dense output.
+/// The derivative at the end of a step is reused as the first stage of the next step.
+/// </summary>
+/// <typeparam name="Model">CRTBP model that provides Direction().</typeparam>
+template<typename Model>
+class RK4Stepper
+{
+public:
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	/// <param name="state">Initial state.</param>
+	/// <param name="t">Initial time.</param>
+	/// <param name="settings">Step size and integration duration.</param>
+	RK4Stepper(const Vector4d& state, double t, const IntegratorSettings& settings) :
+		mH(std::copysign(settings.stepSize, settings.duration)), mT(t), mT0(t), mY(state), mY0(state),
+		mK1(Model::Direction(state)), mF0(mK1)
+	{
+		mNumSteps = (int)std::lround(settings.duration / mH);
+		mStats.evaluations = 1;
+	}
+
+	/// <summary>
+	/// Advances by one fixed step.
+	/// </summary>
+	void Step()
+	{
+		const double h = mH;
+		const Vector4d& k1 = mK1;
+		Vector4d k2 = Model::Direction(mY + (h / 2.0) * k1);
+		Vector4d k3 = Model::Direction(mY + (h / 2.0) * k2);
+		Vector4d k4 = Model::Direction(mY + h * k3);
+		Vector4d y1 = mY + (h / 6.0) * (k1 + 2.0 * k2 + 2.0 * k3 + k4);
+
+		mT0 = mT;
+		mY0 = mY;
+		mF0 = mK1;
+		mT += h;
+		mY = y1;
+		mK1 = Model::Direction(y1);
+		mStats.evaluations += 4;
+		mStats.steps++;
+	}
+
+	/// <summary>
+	/// Evaluates the cubic Hermite interpolant of the last step.
+	/// </summary>
+	/// <param name="t">Time inside the last step.</param>
+	/// <returns>Interpolated state.</returns>
+	Vector4d DenseOutput(double t) const
+	{
+		if (mT == mT0) return mY;
+		double h = mT - mT0, theta = (t - mT0) / h;
+		return (1 - theta) * mY0 + theta * mY
+			+ theta * (theta - 1) * ((1 - 2 * theta) * (mY - mY0) + (theta - 1) * h * mF0 + theta * h * mK1);
+	}
+
+	bool Done() const { return mStats.steps >= mNumSteps; }	// true once all fixed steps are taken
+	double Time() const { return mT; }						// time at the end of the last step
+	double PreviousTime() const { return mT0; }				// time at the start of the last step
+	const Vector4d& State() const { return mY; }			// state at the end of the last step
+	const IntegratorStats& Stats() const { return mStats; }
+
+private:
+	double mH;				// signed step size
+	int mNumSteps;			// number of steps to take
+	double mT, mT0;			// time at the end and the start of the last step
+	Vector4d mY, mY0;		// state at the end and the start of the last step
+	Vector4d mK1, mF0;		// derivative at the end and the start of the last step
+	IntegratorStats mStats;
+};
+
+/// <summary>
+/// Event function g(t, state) = 0 that is monitored during an integration.
+/// </summary>
+struct Event
+{
+	std::function<double(double, const Vector4d&)> g;	// event function, a root marks the event
+	int direction = 0;		// +1: only crossings from negative to positive, -1: only from positive to negative, 0: both
+	bool terminal = false;	// stop the integration at the first crossing
+
+	/// <summary>
+	/// Crossing of the plane state[component] = value, e.g. component 1 for y = const.
+	/// </summary>
+	static Event PlaneCrossing(int component, double value, int direction = 0, bool terminal = false)
+	{
+		return Event{ [component, value](double, const Vector4d& s) { return s[component] - value; }, direction, terminal };
+	}
+
+	/// <summary>
+	/// Periapsis around a center: the radial velocity changes from negative to positive.
+	/// </summary>
+	static Event Periapsis(const Vector2d& center, bool terminal = false)
+	{
+		return Event{ [center](double, const Vector4d& s) { return (s[0] - center.x()) * s[2] + (s[1] - center.y()) * s[3]; }, +1, terminal };
+	}
+
+	/// <summary>
+	/// Entering a sphere around a center, e.g. a collision with a primary.
+	/// </summary>
+	static Event Collision(const Vector2d& center, double radius, bool terminal = true)
+	{
+		return Event{ [center, radius](double, const Vector4d& s) { return std::hypot(s[0] - center.x(), s[1] - center.y()) - radius; }, -1, terminal };
+	}
+
+	/// <summary>
+	/// Leaving a sphere around the barycenter, i.e. an escape.
+	/// </summary>
+	static Event Escape(double radius, bool terminal = true)
+	{
+		return Event{ [radius](double, const Vector4d& s) { return std::hypot(s[0], s[1]) - radius; }, +1, terminal };
+	}
+
+	/// <summary>
+	/// Terminal events that end every trajectory: the collisions with the Sun and the Earth and the escape,
+	/// in this order. All integrations of a single trajectory share them, so that they stop at the same states.
+	/// </summary>
+	template<typename Model>
+	static std::vector<Event> Terminations(const TerminationSettings& limits)
+	{
+		return {
+			Collision(Model::Sun(), limits.sunRadius),
+			Collision(Model::Earth(), limits.earthRadius),
+			Escape(limits.escapeRadius)
+		};
+	}
+};
+
+/// <summary>
+/// Crossing of an event function that was found during an integration.
+/// </summary>
+struct EventHit
+{
+	int event;			// index of the event in the list of registered events
+	double t;			// refined time of the crossing
+	Vector4d state;		// state at the crossing
+};
+
+/// <summary>
+/// Class that integrates trajectories with the scheme selected in the IntegratorSettings.
+/// </summary>
+class Integrator
+{
+public:
+	/// <summary>
+	/// Integrates a trajectory and emits states along the way.
+	/// RK4 emits the state after every fixed step. Dormand-Prince emits the dense output every outputInterval,
+	/// independent of the internal step count.
+	/// The event functions are evaluated after every step. Their crossings are refined by root finding on the dense
+	/// output of the step. A terminal event ends the integration: its state is the last one that is emitted.
+	/// Without events, the only overhead is one check per step.
+	/// The stop predicate is checked once after every accepted step whose outputs were emitted; it ends the
+	/// integration without emitting a further state, so the outputs stay those of an uninterrupted integration.
+	/// </summary>
+	/// <typeparam name="Model">CRTBP model that provides Direction().</typeparam>
+	/// <param name="state">Initial state.</param>
+	/// <param name="settings">Integration settings.</param>
+	/// <param name="emit">Callback emit(t, state), called for the initial state and every output state.</param>
+	/// <param name="events">Event functions to monitor.</param>
+	/// <param name="hits">Receives the crossings of the event functions in the order they occur, may be null.</param>
+	/// <param name="stopped">Returns true once the integration should end early, e.g. because its result is no
+	/// longer needed or a time budget is used up. May be empty.</param>
+	/// <returns>Step and evaluation counters.</returns>
+	template<typename Model, typename Emit>
+	static IntegratorStats Integrate(const Vector4d& state, const IntegratorSettings& settings, Emit&& emit,
+		const std::vector<Event>& events = {}, std::vector<EventHit>* hits = nullptr, const std::function<bool()>& stopped = nullptr)
+	{
+		emit(0.0, state);
+		if (settings.type == IntegratorType::RK4)
+		{
+			RK4Stepper<Model> stepper(state, 0.0, settings);
+			return Run(stepper, settings, false, emit, events, hits, stopped);
+		}
+		DormandPrince54<Model> stepper(state, 0.0, settings);
+		return Run(stepper, settings, true, emit, events, hits, stopped);
+	}
+
+	/// <summary>
+	/// Performs one classic Runge-Kutta step.
+	/// </summary>
+	/// <typeparam name="Model">CRTBP model that provides Direction().</typeparam>
+	/// <param name="state">State at the beginning of the step.</param>
+	/// <param name="h">Step size.</param>
+	/// <returns>State at the end of the step.</returns>
+	template<typename Model>
+	static Vector4d StepRK4(const Vector4d& state, double h)
+	{
+		Vector4d k1 = Model::Direction(state);
+		Vector4d k2 = Model::Direction(state + (h / 2.0) * k1);
+		Vector4d k3 = Model::Direction(state + (h / 2.0) * k2);
+		Vector4d k4 = Model::Direction(state + h * k3);
+		return state + (h / 6.0) * (k1 + 2.0 * k2 + 2.0 * k3 + k4);
+	}
+
+	/// <summary>
+	/// Finds the crossings of the event functions within the last step of a stepper.
+	/// </summary>
+	/// <param name="stepper">Stepper whose last step is searched.</param>
+	/// <param name="events">Event functions.</param>
+	/// <param name="g">Values of the event functions at the start of the step, updated to the values at its end.</param>
+	/// <param name="found">Receives the crossings in this step, sorted by time and cut off after the first terminal event.</param>
+	/// <returns>True if a terminal event occurred.</returns>
+	template<typename Stepper>
+	static bool DetectEvents(const Stepper& stepper, const std::vector<Event>& events, std::vector<double>& g, std::vector<EventHit>& found)
+	{
+		found.clear();
+		const double t0 = stepper.PreviousTime(), t1 = stepper.Time();
+		for (size_t i = 0; i < events.size(); ++i)
+		{
+			const Event& event = events[i];
+			double g0 = g[i], g1 = event.g(t1, stepper.State());
+			g[i] = g1;
+			if (g0 == 0 || ((g0 < 0) == (g1 < 0) && g1 != 0)) continue;
+			int direction = g0 < 0 ? +1 : -1;
+			if (event.direction != 0 && event.direction != direction) continue;
+
+			// Illinois variant of regula falsi on the dense output
+			auto phi = [&](double t) { return event.g(t, stepper.DenseOutput(t)); };
+			double a = t0, b = t1, fa = g0, fb = g1, t = t1;
+			int side = 0;
+			for (int iter = 0; iter < 60 && fb != 0 && std::abs(b - a) > 1e-13 * (1 + std::abs(t1)); ++iter)
+			{
+				t = (a * fb - b * fa) / (fb - fa);
+				double ft = phi(t);
+				if (ft == 0) break;
+				if ((ft < 0) == (fb < 0))
+				{
+					b = t; fb = ft;
+					if (side == -1) fa /= 2;
+					side = -1;
+				}
+				else
+				{
+					a = t; fa = ft;
+					if (side == +1) fb /= 2;
+					side = +1;
+				}
+			}
+			found.push_back(EventHit{ (int)i, t, stepper.DenseOutput(t) });
+		}
+		if (found.empty()) return false;
+
+		double dir = t1 < t0 ? -1.0 : 1.0;
+		std::sort(found.begin(), found.end(), [dir](const EventHit& l, const EventHit& r) { return dir * l.t < dir * r.t; });
+		for (size_t i = 0; i < found.size(); ++i)
+		{
+			if (events[found[i].event].terminal)
+			{
+				found.resize(i + 1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	/// <summary>
+	/// Runs a stepper to the end of the integration, emits output states and handles events.
+	/// </summary>
+	template<typename Stepper, typename Emit>
+	static IntegratorStats Run(Stepper& stepper, const IntegratorSettings& settings, bool denseSampling, Emit& emit,
+		const std::vector<Event>& events, std::vector<EventHit>* hits, const std::function<bool()>& stopped)
+	{
+		const double dir = settings.duration < 0 ? -1.0 : 1.0;
+		const double dt = dir * std::abs(settings.outputInterval);
+		const int numOutputs = denseSampling ? (int)std::floor(settings.duration / dt + 1e-9) : 0;
+		int next = 1;
+
+		std::vector<double> g(events.size());
+		std::vector<EventHit> found;
+		for (size_t i = 0; i < events.size(); ++i)
+			g[i] = events[i].g(stepper.Time(), stepper.State());
+
+		while (!stepper.Done())
+		{
+			stepper.Step();
+
+			bool stop = false;
+			double tStop = stepper.Time();
+			if (!events.empty())
+			{
+				stop = DetectEvents(stepper, events, g, found);
+				if (hits) hits->insert(hits->end(), found.begin(), found.end());
+				if (stop) tStop = found.back().t;
+			}
+
+			if (denseSampling)
+			{
+				// outputs before a terminal event, or up to the end of the step (all remaining ones after the last step)
+				auto due = [&](double t) { return stop ? dir * (t - tStop) < 0 : stepper.Done() || dir * (t - tStop) <= 0; };
+				while (next <= numOutputs && due(next * dt))
+				{
+					emit(next * dt, stepper.DenseOutput(next * dt));
+					++next;
+				}
+			}
+			else if (!stop)
+				emit(stepper.Time(), stepper.State());
+
+			if (stop)
+			{
+				emit(tStop, found.back().state);
+				break;
+			}
+			if (stopped && !stepper.Done() && stopped())
+				break;
+		}
+		return stepper.Stats();
+	}
+};
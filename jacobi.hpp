@@ -3,7 +3,7 @@
 #include <vtkImageData.h>
 #include <vtkDoubleArray.h>
 #include <vtkPointData.h>
-#include <vtkContourFilter.h>
+#include <vtkPolyData.h>
 #include <vtkPolyDataMapper.h>
 #include <vtkActor.h>
 #include <vtkRenderer.h>
@@ -16,13 +16,19 @@
 #include <vtkOutlineFilter.h>
 
 #include "crtbp.hpp" // Your CRTBP class header
+#include "threadpool.hpp"
+#include "spanspace.hpp"
+
+#include <algorithm>
+#include <vector>
 
 
 
 class JacobiConstant
 {
 public:
-    JacobiConstant()
+    explicit JacobiConstant(int resolution = DEFAULT_RESOLUTION)
+        : m_resolution(std::clamp(resolution, 2, MAX_RESOLUTION))
     {
 
         CreateGrid();
@@ -32,6 +38,27 @@ public:
 
     vtkSmartPointer<vtkImageData> GetImageData() const { return m_imageData; }
 
+    int GetResolution() const { return m_resolution; }
+
+    // Resamples the field with resolution x resolution samples, at most MAX_RESOLUTION per axis, and updates the contour.
+    void SetResolution(int resolution)
+    {
+        resolution = std::clamp(resolution, 2, MAX_RESOLUTION);
+        if (resolution == m_resolution) return;
+        m_resolution = resolution;
+        SetGeometry();
+        SampleField();
+        m_imageData->Modified();
+        UpdateContour();
+    }
+
+    // Extracts the contour at a new isovalue from the span-space index; only the blocks crossing it are visited.
+    void SetContourValue(double value)
+    {
+        m_contourValue = value;
+        UpdateContour();
+    }
+
     void InitRenderer(vtkRenderer* renderer)
     {
         if (renderer && m_contourActor && m_outlineActor)
@@ -41,6 +68,14 @@ public:
         }
     }
 
+    // Resamples the field for the system selected by CRTBP::SetSystem and updates the contour.
+    void OnSystemChanged()
+    {
+        SampleField();
+        m_imageData->Modified();
+        UpdateContour();
+    }
+
     void InitUI(vtkRenderWindowInteractor* interactor)
     {
         if (!interactor) return;
@@ -71,16 +106,15 @@ public:
             {
                 auto sliderWidget = reinterpret_cast<vtkSliderWidget*>(caller);
                 double value = static_cast<vtkSliderRepresentation*>(sliderWidget->GetRepresentation())->GetValue();
-                contourFilter->SetValue(0, value);
-                contourFilter->Update();
+                jacobi->SetContourValue(value);
                 sliderWidget->GetInteractor()->GetRenderWindow()->Render();
             }
 
-            vtkContourFilter* contourFilter = nullptr;
+            JacobiConstant* jacobi = nullptr;
         };
 
         vtkSmartPointer<SliderCallback> sliderCallback = vtkSmartPointer<SliderCallback>::New();
-        sliderCallback->contourFilter = m_contourFilter;
+        sliderCallback->jacobi = this;
         m_sliderWidget->AddObserver(vtkCommand::InteractionEvent, sliderCallback);
 
 
@@ -88,8 +122,11 @@ public:
 
 private:
     vtkSmartPointer<vtkImageData> m_imageData;
+    int m_resolution;                       // samples per axis
 
-    vtkSmartPointer<vtkContourFilter> m_contourFilter;
+    vtkSmartPointer<vtkPolyData> m_contour;
+    SpanSpaceContour m_index;               // min/max per block of the field, rebuilt whenever the field is resampled
+    double m_contourValue = INITIAL_CONTOUR_VALUE;
     vtkSmartPointer<vtkPolyDataMapper> m_polyDataMapper;
     vtkSmartPointer<vtkActor> m_contourActor;
     vtkSmartPointer<vtkActor> m_outlineActor;
@@ -101,18 +138,15 @@ private:
     static constexpr double Y_MAX = 2.0;
     static constexpr double Z = 0.0;
     static constexpr double INITIAL_CONTOUR_VALUE = 3.17216;
+    static constexpr int DEFAULT_RESOLUTION = 1024;
+    static constexpr int MAX_RESOLUTION = 8192;
+    static constexpr int ROWS_PER_TASK = 16;
+    static constexpr int CONTOUR_BLOCK_SIZE = 16;
 
     void CreateGrid()
     {
         m_imageData = vtkSmartPointer<vtkImageData>::New();
-        int m_resolution = 50;
-        m_imageData->SetDimensions(m_resolution, m_resolution, 1);
-
-        double spacingX = (X_MAX - X_MIN) / (m_resolution - 1);
-        double spacingY = (Y_MAX - Y_MIN) / (m_resolution - 1);
-        m_imageData->SetSpacing(spacingX, spacingY, 1.0);
-        m_imageData->SetOrigin(X_MIN, Y_MIN, Z);
-        m_imageData->AllocateScalars(VTK_DOUBLE, 1);
+        SetGeometry();
 
         // 1) Create an outline of the image data
         auto outline = vtkSmartPointer<vtkOutlineFilter>::New();
@@ -129,33 +163,64 @@ private:
         m_outlineActor->GetProperty()->SetLineWidth(2);
     }
 
+    // Sets dimensions and spacing for the current resolution and (re)allocates the scalars.
+    void SetGeometry()
+    {
+        m_imageData->SetDimensions(m_resolution, m_resolution, 1);
+
+        double spacingX = (X_MAX - X_MIN) / (m_resolution - 1);
+        double spacingY = (Y_MAX - Y_MIN) / (m_resolution - 1);
+        m_imageData->SetSpacing(spacingX, spacingY, 1.0);
+        m_imageData->SetOrigin(X_MIN, Y_MIN, Z);
+        m_imageData->AllocateScalars(VTK_DOUBLE, 1);
+    }
+
+    // Samples the Jacobi constant at zero velocity, C = 2 U, into the scalar buffer.
+    // The rows are split across the thread pool and each row goes through the batched potential kernel.
     void SampleField()
     {
-        int m_resolution = 50;
-        for (int j = 0; j < m_resolution; ++j)
+        const int n = m_resolution;
+        double* scalars = static_cast<double*>(m_imageData->GetScalarPointer());
+        std::vector<double> xs(n);
+        double spacingX = (X_MAX - X_MIN) / (n - 1), spacingY = (Y_MAX - Y_MIN) / (n - 1);
+        for (int i = 0; i < n; ++i)
+            xs[i] = X_MIN + i * spacingX;
+
+        CRTBP::Dispatch([&](auto model)
         {
-            for (int i = 0; i < m_resolution; ++i)
+            using Model = decltype(model);
+            ThreadPool::Shared().ParallelFor(0, n, ROWS_PER_TASK, [&](size_t begin, size_t end)
             {
-                double x = X_MIN + i * (X_MAX - X_MIN) / (m_resolution - 1);
-                double y = Y_MIN + j * (Y_MAX - Y_MIN) / (m_resolution - 1);
-                Vector2d pos(x, y);
-                double jacobiValue = CRTBP::JacobiConstant(pos, 0);
-                double* pixel = static_cast<double*>(m_imageData->GetScalarPointer(i, j, 0));
-                *pixel = jacobiValue;
-            }
-        }
+                std::vector<double> ys(n);
+                for (size_t j = begin; j < end; ++j)
+                {
+                    double* row = scalars + j * n;
+                    std::fill(ys.begin(), ys.end(), Y_MIN + j * spacingY);
+                    Model::PseudoPotentialBatch(xs.data(), ys.data(), row, n);
+                    for (int i = 0; i < n; ++i)
+                        row[i] *= 2;
+                }
+            });
+        });
+        m_index.Build(scalars, n, n, CONTOUR_BLOCK_SIZE);
+    }
 
+    // Replaces the contour by the one at m_contourValue.
+    void UpdateContour()
+    {
+        double origin[2] = { X_MIN, Y_MIN };
+        double spacing[2] = { (X_MAX - X_MIN) / (m_resolution - 1), (Y_MAX - Y_MIN) / (m_resolution - 1) };
+        m_index.Extract(m_contourValue, origin, spacing, m_contour);
+        m_contour->Modified();
     }
 
     void CreateContour()
     {
-        m_contourFilter = vtkSmartPointer<vtkContourFilter>::New();
-        m_contourFilter->SetInputData(m_imageData);
-        m_contourFilter->SetValue(0, INITIAL_CONTOUR_VALUE);
-        m_contourFilter->Update();
+        m_contour = vtkSmartPointer<vtkPolyData>::New();
+        UpdateContour();
 
         m_polyDataMapper = vtkSmartPointer<vtkPolyDataMapper>::New();
-        m_polyDataMapper->SetInputConnection(m_contourFilter->GetOutputPort());
+        m_polyDataMapper->SetInputData(m_contour);
         m_polyDataMapper->ScalarVisibilityOff();
 
         m_contourActor = vtkSmartPointer<vtkActor>::New();
@@ -1,14 +1,58 @@
 #include "window.hpp"
 
 #include <memory>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
 
 
 
+/// <summary>
+/// Parses a command line number, the whole argument has to be a finite number.
+/// </summary>
+/// <param name="text">Command line argument.</param>
+/// <param name="value">Receives the number.</param>
+/// <returns>True if the argument is a number.</returns>
+static bool ParseNumber(const char* text, double& value)
+{
+	char* end = nullptr;
+	value = std::strtod(text, &end);
+	return end != text && *end == '\0' && std::isfinite(value);
+}
 
-
-int main(int, char* [])
+/// <summary>
+/// Usage: scivis [system | mu [omega]], where system is the name of a predefined CRTBP system (e.g. Earth-Moon).
+/// </summary>
+int main(int argc, char* argv[])
 {
+	if (argc > 1)
+	{
+		CRTBPSystem system{ "Custom", 0.0, 1.0 };
+		bool preset = false;
+		for (const auto& candidate : CRTBP::Presets())
+			if (candidate.name == argv[1])
+			{
+				system = candidate;
+				preset = true;
+			}
+
+		// a custom system needs 0 < mu <= 0.5, the smaller mass is the Earth, and a positive rotation rate
+		bool valid = preset || (ParseNumber(argv[1], system.mu) && system.mu > 0 && system.mu <= 0.5
+			&& (argc < 3 || (ParseNumber(argv[2], system.omega) && system.omega > 0)));
+		if (!valid)
+		{
+			std::cerr << "Usage: " << argv[0] << " [system | mu [omega]] with 0 < mu <= 0.5 and omega > 0" << std::endl;
+			std::cerr << "Predefined systems:";
+			for (const auto& candidate : CRTBP::Presets())
+				std::cerr << " " << candidate.name;
+			std::cerr << std::endl;
+			return EXIT_FAILURE;
+		}
+		CRTBP::SetSystem(system);
+	}
+
 	auto window = std::make_unique<Window>();
 	window->Loop();
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
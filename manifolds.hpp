@@ -0,0 +1,354 @@
+#pragma once
+
+#include "periodic.hpp"
+#include "integrator.hpp"
+#include "threadpool.hpp"
+#include "tracerset.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkTextActor.h>
+#include <vtkTextProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Invariant manifold of a periodic orbit.
+/// </summary>
+enum class ManifoldType
+{
+	Stable,		// states that approach the orbit, integrated backwards in time
+	Unstable	// states that depart from the orbit, integrated forwards in time
+};
+
+/// <summary>
+/// Crossing of a manifold trajectory with the section x = const.
+/// </summary>
+struct ManifoldCrossing
+{
+	Vector4d state;		// state at the crossing, (y, vy) are the section coordinates
+	double time;		// signed time from the seed to the crossing
+	int seed;			// index of the seed along the orbit
+	int side;			// +1 or -1, side of the orbit the seed was displaced to
+	ManifoldType type;	// manifold the trajectory belongs to
+};
+
+/// <summary>
+/// Class that computes the stable and unstable manifolds of a periodic orbit. The monodromy eigenvectors are
+/// transported along the orbit with the state transition matrix, and seeds displaced by a small step along
+/// them on both sides of the orbit are integrated with Dormand-Prince on the thread pool. A trajectory stops
+/// at its first crossing of the section x = const, a collision, an escape or the time limit. The finished
+/// trajectories are streamed into a TracerSet as they arrive, and their section crossings are collected for
+/// the search of connections between orbits.
+/// </summary>
+class InvariantManifolds
+{
+public:
+	/// <summary>
+	/// Settings of the manifold computation.
+	/// </summary>
+	struct Settings
+	{
+		int seedsPerOrbit = 100;		// seeds along the orbit per manifold and side
+		double perturbation = 1e-3;		// displacement of the seeds relative to the distance of the orbit from the Earth
+		double sectionOffset = 0;		// the section is the plane x = x_Earth + sectionOffset
+		double maxTime = 10;			// trajectories that do not reach the section stop after this time
+		double outputInterval = 0.01;	// time between two rendered points
+		bool stable = true;				// compute the stable manifold
+		bool unstable = true;			// compute the unstable manifold
+		double stepSize = 1e-3;			// RK4 step size of the STM propagation along the orbit
+	};
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	InvariantManifolds() : mTrajectories(std::make_unique<TracerSet>())
+	{
+		mProgress = vtkSmartPointer<vtkTextActor>::New();
+		mProgress->GetTextProperty()->SetFontSize(14);
+		mProgress->GetTextProperty()->SetColor(0.8, 0.8, 0.8);
+		mProgress->SetDisplayPosition(10, 100);
+	}
+
+	/// <summary>
+	/// Destructor. Cancels the running computation.
+	/// </summary>
+	~InvariantManifolds() { Cancel(); }
+
+	/// <summary>
+	/// Adds the actors to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actors to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		mTrajectories->InitRenderer(renderer);
+		renderer->AddActor2D(mProgress);
+	}
+
+	/// <summary>
+	/// Gets the settings that are used by the next call to Start().
+	/// </summary>
+	Settings& GetSettings() { return mSettings; }
+
+	/// <summary>
+	/// Gets the section crossings that arrived so far.
+	/// </summary>
+	const std::vector<ManifoldCrossing>& GetCrossings() const { return mCrossings; }
+
+	/// <summary>
+	/// Gets the x-coordinate of the section of the current computation.
+	/// </summary>
+	double GetSectionX() const { return mSectionX; }
+
+	/// <summary>
+	/// Gets the orbit of the current computation.
+	/// </summary>
+	const PeriodicOrbit& GetOrbit() const { return mOrbit; }
+
+	/// <summary>
+	/// Checks whether all trajectories of the current computation finished and their crossings arrived, i.e.
+	/// GetCrossings() holds all crossings of the manifolds of the orbit.
+	/// </summary>
+	bool IsComplete() const
+	{
+		if (!mJob || mJob->cancelled || mJob->failed) return false;
+		std::lock_guard<std::mutex> lock(mJob->mutex);
+		return mJob->finished == mJob->total && mJob->pending.empty();
+	}
+
+	/// <summary>
+	/// Discards the current manifolds and starts computing the manifolds of a periodic orbit in the background.
+	/// </summary>
+	/// <param name="orbit">Converged periodic orbit, e.g., a member of an OrbitFamily.</param>
+	void Start(const PeriodicOrbit& orbit)
+	{
+		Cancel();
+		Clear();
+		mOrbit = orbit;
+		mSectionX = CRTBP::Earth().x() + mSettings.sectionOffset;
+
+		auto job = std::make_shared<Job>();
+		mJob = job;
+		Settings settings = mSettings;
+		job->total = settings.seedsPerOrbit * 2 * ((int)settings.stable + (int)settings.unstable);
+		double sectionX = mSectionX;
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			ThreadPool::Shared().Submit([job, orbit, sectionX, settings] { Compute<Model>(*job, orbit, sectionX, settings); });
+		});
+	}
+
+	/// <summary>
+	/// Stops the background computation. Trajectories that were already finished stay visible.
+	/// </summary>
+	void Cancel()
+	{
+		if (mJob) mJob->cancelled = true;
+	}
+
+	/// <summary>
+	/// Moves the trajectories that finished since the last call into the rendered set and updates the progress.
+	/// </summary>
+	void Update()
+	{
+		if (!mJob) return;
+
+		std::vector<Trajectory> trajectories;
+		{
+			std::lock_guard<std::mutex> lock(mJob->mutex);
+			trajectories.swap(mJob->pending);
+		}
+		for (const Trajectory& trajectory : trajectories)
+		{
+			// red for the unstable manifold, green for the stable one, lighter on the minus side
+			Vector3d color = trajectory.type == ManifoldType::Unstable ? Vector3d(1.0, 0.25, 0.2) : Vector3d(0.2, 0.85, 0.3);
+			if (trajectory.side < 0) color = 0.6 * color + Vector3d::Constant(0.4);
+			mTrajectories->Add(trajectory.points.size(), [&](size_t j) { return trajectory.points[j]; }, color);
+			if (trajectory.crossed)
+				mCrossings.push_back(trajectory.crossing);
+		}
+
+		std::string text;
+		if (mJob->failed)
+			text = "Manifolds: the orbit has no real unstable eigenvalue";
+		else
+		{
+			text = "Manifolds of the orbit at C " + std::to_string(mOrbit.jacobi) + ": " + std::to_string(mJob->finished.load())
+				+ " / " + std::to_string(mJob->total) + " trajectories, " + std::to_string(mCrossings.size())
+				+ " crossings of x = " + std::to_string(mSectionX);
+		}
+		mProgress->SetInput(text.c_str());
+	}
+
+	/// <summary>
+	/// Cancels the computation and clears the manifolds, since they no longer match the selected CRTBP system.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		Cancel();
+		Clear();
+		mJob.reset();
+		mProgress->SetInput("");
+	}
+
+private:
+	InvariantManifolds(const InvariantManifolds&) = delete;		// Delete the copy-constructor.
+	void operator=(const InvariantManifolds&) = delete;			// Delete the assignment operator.
+
+	/// <summary>
+	/// Finished manifold trajectory.
+	/// </summary>
+	struct Trajectory
+	{
+		std::vector<Vector2d> points;		// rendered positions
+		ManifoldType type;					// manifold the trajectory belongs to
+		int side;							// side of the orbit the seed was displaced to
+		bool crossed = false;				// the trajectory stopped at the section
+		ManifoldCrossing crossing;			// crossing with the section, if crossed
+	};
+
+	/// <summary>
+	/// State that is shared between the scene component and the worker tasks of one computation.
+	/// </summary>
+	struct Job
+	{
+		std::atomic<bool> cancelled{ false };	// set to stop all tasks of this job
+		std::atomic<bool> failed{ false };		// the orbit has no manifolds
+		std::atomic<int> finished{ 0 };			// number of trajectories that are done
+		int total = 0;							// number of trajectories in this job
+		std::mutex mutex;						// guards pending
+		std::vector<Trajectory> pending;		// trajectories that were not yet moved into the rendered set
+	};
+
+	/// <summary>
+	/// Seed of a manifold trajectory.
+	/// </summary>
+	struct Seed
+	{
+		Vector4d state;
+		int index, side;
+		ManifoldType type;
+	};
+
+	/// <summary>
+	/// Seeds the manifolds along the orbit and integrates the seeds, runs on a pool thread and distributes the
+	/// trajectories over the pool.
+	/// </summary>
+	template<typename Model>
+	static void Compute(Job& job, const PeriodicOrbit& orbit, double sectionX, const Settings& settings)
+	{
+		// states and STMs at the seed times; the STM at the end is the monodromy matrix
+		int n = settings.seedsPerOrbit;
+		int substeps = std::max(1, (int)std::ceil(orbit.period / n / settings.stepSize));
+		double h = orbit.period / n / substeps;
+		std::vector<DifferentialCorrector::AugmentedState> samples(n + 1);
+		samples[0].col(0) = orbit.state;
+		samples[0].template rightCols<4>().setIdentity();
+		for (int i = 0; i < n; ++i)
+		{
+			samples[i + 1] = samples[i];
+			for (int s = 0; s < substeps; ++s)
+				samples[i + 1] = DifferentialCorrector::Step<Model>(samples[i + 1], h);
+		}
+
+		// eigenvectors of the real reciprocal pair lambda > 1 and 1 / lambda
+		Matrix4d monodromy = samples[n].template rightCols<4>();
+		vtkeigen::EigenSolver<Matrix4d> solver(monodromy);
+		int largest = -1, smallest = -1;
+		for (int i = 0; i < 4; ++i)
+		{
+			auto lambda = solver.eigenvalues()[i];
+			if (std::abs(lambda.imag()) > 1e-8 * std::abs(lambda)) continue;
+			if (largest < 0 || std::abs(lambda.real()) > std::abs(solver.eigenvalues()[largest].real())) largest = i;
+			if (smallest < 0 || std::abs(lambda.real()) < std::abs(solver.eigenvalues()[smallest].real())) smallest = i;
+		}
+		if (largest < 0 || std::abs(solver.eigenvalues()[largest].real()) < 1 + 1e-6)
+		{
+			job.failed = true;
+			return;
+		}
+		Vector4d unstable = solver.eigenvectors().col(largest).real();
+		Vector4d stable = solver.eigenvectors().col(smallest).real();
+
+		// seeds displaced along the transported eigenvectors, normalized by their position part
+		double epsilon = settings.perturbation * std::abs(orbit.state.x() - Model::Earth().x());
+		std::vector<Seed> seeds;
+		for (ManifoldType type : { ManifoldType::Unstable, ManifoldType::Stable })
+		{
+			if (type == ManifoldType::Unstable ? !settings.unstable : !settings.stable) continue;
+			const Vector4d& v = type == ManifoldType::Unstable ? unstable : stable;
+			for (int i = 0; i < n; ++i)
+			{
+				Vector4d w = samples[i].template rightCols<4>() * v;
+				w /= w.head<2>().norm();
+				for (int side : { 1, -1 })
+					seeds.push_back(Seed{ samples[i].col(0) + side * epsilon * w, i, side, type });
+			}
+		}
+
+		ThreadPool::Shared().ParallelFor(0, seeds.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end && !job.cancelled; ++i)
+			{
+				Trajectory trajectory = Trace<Model>(job, seeds[i], sectionX, settings);
+				std::lock_guard<std::mutex> lock(job.mutex);
+				job.pending.push_back(std::move(trajectory));
+				job.finished++;		// counted with the pending trajectory, so that IsComplete() sees both
+			}
+		});
+	}
+
+	/// <summary>
+	/// Integrates one seed until it crosses the section, collides, escapes or reaches the time limit.
+	/// </summary>
+	template<typename Model>
+	static Trajectory Trace(Job& job, const Seed& seed, double sectionX, const Settings& settings)
+	{
+		IntegratorSettings integrator;
+		integrator.type = IntegratorType::DormandPrince54;
+		integrator.duration = seed.type == ManifoldType::Unstable ? settings.maxTime : -settings.maxTime;
+		integrator.outputInterval = settings.outputInterval;
+
+		std::vector<Event> events = { Event::PlaneCrossing(0, sectionX, 0, true) };
+		std::vector<Event> terminations = Event::Terminations<Model>(TerminationSettings());
+		events.insert(events.end(), terminations.begin(), terminations.end());
+
+		Trajectory trajectory;
+		trajectory.type = seed.type;
+		trajectory.side = seed.side;
+		std::vector<EventHit> hits;
+		Integrator::Integrate<Model>(seed.state, integrator,
+			[&](double, const Vector4d& s) { trajectory.points.push_back(s.head<2>()); }, events, &hits,
+			[&job] { return job.cancelled.load(); });
+		if (!hits.empty() && hits.back().event == 0)
+		{
+			trajectory.crossed = true;
+			trajectory.crossing = ManifoldCrossing{ hits.back().state, hits.back().t, seed.index, seed.side, seed.type };
+		}
+		return trajectory;
+	}
+
+	/// <summary>
+	/// Removes the rendered trajectories and the crossings.
+	/// </summary>
+	void Clear()
+	{
+		mTrajectories->Clear();
+		mCrossings.clear();
+	}
+
+	Settings mSettings;								// settings of the next computation
+	std::shared_ptr<Job> mJob;						// running or finished computation
+	PeriodicOrbit mOrbit;							// orbit of the current computation
+	double mSectionX = 0;							// x-coordinate of the section of the current computation
+	std::vector<ManifoldCrossing> mCrossings;		// section crossings in the order of arrival
+	std::unique_ptr<TracerSet> mTrajectories;		// rendered trajectories
+	vtkSmartPointer<vtkTextActor> mProgress;		// progress line
+};
@@ -8,4 +8,5 @@ using Vector2d = vtkeigen::Vector2d;
 using Vector3d = vtkeigen::Vector3d;
 using Vector4d = vtkeigen::Vector4d;
 using Matrix2d = vtkeigen::Matrix2d;
+using Matrix3d = vtkeigen::Matrix3d;
 using Matrix4d = vtkeigen::Matrix4d;
\ No newline at end of file
@@ -0,0 +1,308 @@
+#pragma once
+
+#include "ensemble.hpp"
+#include "threadpool.hpp"
+#include "tracer.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkFloatArray.h>
+#include <vtkPolyData.h>
+#include <vtkPointGaussianMapper.h>
+#include <vtkActor.h>
+#include <vtkProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Policy for particles that collided with a primary or escaped.
+/// </summary>
+enum class RespawnPolicy
+{
+	Reseed,		// start again from a new random seed
+	Restart,	// start again from the own initial state
+	Freeze		// stay where the particle terminated
+};
+
+/// <summary>
+/// Class that animates many massless test bodies in the CRTBP flow. The states are kept in structure-of-arrays
+/// blocks that are advanced by the batched RK4 kernel on the thread pool in every Update. Each block writes its
+/// positions in place into a single float point buffer, which is drawn as point sprites. Frozen particles are
+/// packed behind the live ones, so the kernel only advances the live lanes.
+/// </summary>
+class ParticleSystem
+{
+public:
+	/// <summary>
+	/// Settings of the particle system.
+	/// </summary>
+	struct Settings
+	{
+		int numParticles = 100000;				// number of particles
+		int blockSize = 2048;					// particles per block, i.e., per task
+		double jacobiLevel = Tracer::GetJacobiLevel();	// Jacobi constant of the seeds, the level of the tracer
+		double seedRadius = 0.3;				// seeds are placed within this distance from the Earth
+		double stepSize = 0.005;				// RK4 step size
+		int stepsPerUpdate = 2;					// RK4 steps per Update
+		double maxAge = 20;						// particles respawn after this integration time, 0 never
+		RespawnPolicy policy = RespawnPolicy::Reseed;	// what happens to collided, escaped and aged particles
+	};
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	ParticleSystem()
+	{
+		mPoints = vtkSmartPointer<vtkPoints>::New();
+		mPoints->SetDataTypeToFloat();
+		mPolyData = vtkSmartPointer<vtkPolyData>::New();
+		mPolyData->SetPoints(mPoints);
+
+		auto mapper = vtkSmartPointer<vtkPointGaussianMapper>::New();
+		mapper->SetInputData(mPolyData);
+		mapper->EmissiveOff();
+		mapper->SetScaleFactor(0.004);
+		mapper->ScalarVisibilityOff();
+
+		mActor = vtkSmartPointer<vtkActor>::New();
+		mActor->SetMapper(mapper);
+		mActor->GetProperty()->SetColor(0.6, 0.9, 1.0);
+		mActor->VisibilityOff();
+	}
+
+	/// <summary>
+	/// Gets the settings, changes apply on the next Start.
+	/// </summary>
+	Settings& GetSettings() { return mSettings; }
+
+	/// <summary>
+	/// Seeds all particles and starts the animation.
+	/// </summary>
+	void Start()
+	{
+		int n = mSettings.numParticles, size = mSettings.blockSize;
+		mBlocks.clear();
+		mBlocks.resize((n + size - 1) / size);
+		mPoints->SetNumberOfPoints(n);
+		float* coords = vtkFloatArray::SafeDownCast(mPoints->GetData())->GetPointer(0);
+
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			ThreadPool::Shared().ParallelFor(0, mBlocks.size(), 1, [&](size_t begin, size_t end)
+			{
+				for (size_t b = begin; b < end; ++b)
+				{
+					Block& block = mBlocks[b];
+					size_t lanes = std::min<size_t>(size, n - b * size);
+					block.first = b * size;
+					block.rng.seed((unsigned)b);
+					block.s.Resize(lanes);
+					block.start.Resize(lanes);
+					block.tmp.Resize(lanes);
+					for (auto& k : block.k) k.Resize(lanes);
+					block.age.assign(lanes, 0.0);
+					block.live = lanes;
+					for (size_t i = 0; i < lanes; ++i)
+					{
+						Seed<Model>(block, i);
+						block.start.x[i] = block.s.x[i]; block.start.y[i] = block.s.y[i];
+						block.start.vx[i] = block.s.vx[i]; block.start.vy[i] = block.s.vy[i];
+					}
+					Write(block, coords);
+				}
+			});
+		});
+		mPoints->Modified();
+		mRunning = true;
+		mActor->VisibilityOn();
+	}
+
+	/// <summary>
+	/// Starts the animation on first use, afterwards pauses and hides it or resumes it.
+	/// </summary>
+	void Toggle()
+	{
+		if (mBlocks.empty())
+			Start();
+		else
+		{
+			mRunning = !mRunning;
+			mActor->SetVisibility(mRunning);
+		}
+	}
+
+	/// <summary>
+	/// Advances all particles by the steps of one Update and writes their positions into the point buffer.
+	/// </summary>
+	void Update()
+	{
+		if (!mRunning) return;
+		float* coords = vtkFloatArray::SafeDownCast(mPoints->GetData())->GetPointer(0);
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			ThreadPool::Shared().ParallelFor(0, mBlocks.size(), 1, [&](size_t begin, size_t end)
+			{
+				for (size_t b = begin; b < end; ++b)
+				{
+					Block& block = mBlocks[b];
+					for (int step = 0; step < mSettings.stepsPerUpdate; ++step)
+					{
+						EnsembleIntegrator::StepRK4<Model>(block.s, block.tmp, block.k, block.live, mSettings.stepSize);
+						Respawn<Model>(block);
+					}
+					Write(block, coords);
+				}
+			});
+		});
+		mPoints->Modified();
+	}
+
+	/// <summary>
+	/// Reseeds the particles in the system selected by CRTBP::SetSystem.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		if (!mBlocks.empty())
+			Start();
+	}
+
+	/// <summary>
+	/// Adds the actor to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actor to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		renderer->AddActor(mActor);
+	}
+
+private:
+	ParticleSystem(const ParticleSystem&) = delete;		// Delete the copy-constructor.
+	void operator=(const ParticleSystem&) = delete;		// Delete the assignment operator.
+
+	/// <summary>
+	/// Particles that are advanced together by one task.
+	/// </summary>
+	struct Block
+	{
+		size_t first = 0;				// index of the first particle in the point buffer
+		StateBlock s;					// current states
+		StateBlock start;				// initial states for RespawnPolicy::Restart
+		StateBlock tmp, k[4];			// scratch of the RK4 kernel
+		std::vector<double> age;		// integration time since the last (re)spawn
+		size_t live = 0;				// number of lanes advanced by the kernel, followed by the frozen ones
+		std::mt19937 rng;				// random numbers of the seeds
+	};
+
+	/// <summary>
+	/// Places lane i of a block at a random position around the Earth at which the Jacobi level is reachable,
+	/// moving in a random direction.
+	/// </summary>
+	template<typename Model>
+	void Seed(Block& block, size_t i)
+	{
+		std::uniform_real_distribution<double> unit(0.0, 1.0);
+		TerminationSettings limits;
+		Vector2d pos = Model::Earth() + Vector2d(2 * limits.earthRadius, 0);	// at rest, if no reachable position is found
+		double v2 = 0;
+		for (int attempt = 0; attempt < 64; ++attempt)
+		{
+			double r = std::sqrt(unit(block.rng)) * mSettings.seedRadius, phi = 2 * EIGEN_PI * unit(block.rng);
+			Vector2d candidate = Model::Earth() + r * Vector2d(std::cos(phi), std::sin(phi));
+			double candidateV2 = 2 * Model::PseudoPotential(candidate) - mSettings.jacobiLevel;
+			if (r > limits.earthRadius && candidateV2 > 0)
+			{
+				pos = candidate;
+				v2 = candidateV2;
+				break;
+			}
+		}
+		double theta = 2 * EIGEN_PI * unit(block.rng), v = std::sqrt(v2);
+		block.s.x[i] = pos.x(); block.s.y[i] = pos.y();
+		block.s.vx[i] = v * std::cos(theta); block.s.vy[i] = v * std::sin(theta);
+		block.age[i] = 0;
+	}
+
+	/// <summary>
+	/// Ages the live particles of a block by one step and respawns or freezes the ones that collided, escaped,
+	/// aged or left the finite range. A particle that left the finite range is reseeded under every policy, so that
+	/// the point buffer never holds a non-finite position.
+	/// </summary>
+	template<typename Model>
+	void Respawn(Block& block)
+	{
+		TerminationSettings limits;
+		for (size_t i = 0; i < block.live; )
+		{
+			block.age[i] += mSettings.stepSize;
+			Vector2d pos(block.s.x[i], block.s.y[i]);
+			if (!std::isfinite(pos.x()) || !std::isfinite(pos.y()) || !std::isfinite(block.s.vx[i]) || !std::isfinite(block.s.vy[i]))
+			{
+				// its initial state may lead there again, so it is replaced as well
+				Seed<Model>(block, i);
+				block.start.x[i] = block.s.x[i]; block.start.y[i] = block.s.y[i];
+				block.start.vx[i] = block.s.vx[i]; block.start.vy[i] = block.s.vy[i];
+				++i;
+				continue;
+			}
+			bool terminated = (pos - Model::Sun()).norm() < limits.sunRadius
+				|| (pos - Model::Earth()).norm() < limits.earthRadius
+				|| pos.norm() > limits.escapeRadius
+				|| (mSettings.maxAge > 0 && block.age[i] > mSettings.maxAge);
+			if (!terminated)
+			{
+				++i;
+				continue;
+			}
+
+			switch (mSettings.policy)
+			{
+			case RespawnPolicy::Reseed:
+				Seed<Model>(block, i);
+				break;
+			case RespawnPolicy::Restart:
+				block.s.x[i] = block.start.x[i]; block.s.y[i] = block.start.y[i];
+				block.s.vx[i] = block.start.vx[i]; block.s.vy[i] = block.start.vy[i];
+				block.age[i] = 0;
+				break;
+			case RespawnPolicy::Freeze:
+				// move the particle behind the live lanes, lane i receives the last live particle, which is checked next
+				--block.live;
+				std::swap(block.s.x[i], block.s.x[block.live]); std::swap(block.s.y[i], block.s.y[block.live]);
+				std::swap(block.s.vx[i], block.s.vx[block.live]); std::swap(block.s.vy[i], block.s.vy[block.live]);
+				std::swap(block.start.x[i], block.start.x[block.live]); std::swap(block.start.y[i], block.start.y[block.live]);
+				std::swap(block.start.vx[i], block.start.vx[block.live]); std::swap(block.start.vy[i], block.start.vy[block.live]);
+				std::swap(block.age[i], block.age[block.live]);
+				continue;
+			}
+			++i;
+		}
+	}
+
+	/// <summary>
+	/// Writes the positions of a block into its range of the point buffer.
+	/// </summary>
+	static void Write(const Block& block, float* coords)
+	{
+		float* p = coords + 3 * block.first;
+		for (size_t i = 0; i < block.s.Size(); ++i)
+		{
+			p[3 * i + 0] = (float)block.s.x[i];
+			p[3 * i + 1] = (float)block.s.y[i];
+			p[3 * i + 2] = 0.0f;
+		}
+	}
+
+	Settings mSettings;							// settings of the particle system
+	std::vector<Block> mBlocks;					// states of all particles
+	bool mRunning = false;						// the particles are advanced by Update
+	vtkSmartPointer<vtkPoints> mPoints;			// positions of all particles
+	vtkSmartPointer<vtkPolyData> mPolyData;		// point cloud of the particles
+	vtkSmartPointer<vtkActor> mActor;			// actor that draws the particles as sprites
+};
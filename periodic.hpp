@@ -0,0 +1,223 @@
+#pragma once
+
+#include "crtbp.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+/// <summary>
+/// Symmetric periodic orbit of the planar CRTBP that crosses the x-axis perpendicularly.
+/// </summary>
+struct PeriodicOrbit
+{
+	Vector4d state = Vector4d::Zero();	// initial state on the x-axis, (x, 0, 0, vy)
+	double period = 0;					// full period
+	double jacobi = 0;					// Jacobi constant
+	double stability = 0;				// stability index (|lambda| + 1 / |lambda|) / 2 of the largest monodromy eigenvalue, 1 if linearly stable
+	int iterations = 0;					// differential correction iterations
+	bool converged = false;				// the correction reached the tolerance
+};
+
+/// <summary>
+/// Integrates the state together with its state transition matrix (STM) and corrects initial states of planar
+/// Lyapunov orbits around L1 and L2 by single shooting. The variational equations use the Hessian from the
+/// fused EvalPotential, which also provides the gradient for the state, so each step costs four potential
+/// evaluations for all 20 components. The state and the STM are stored as the columns of one fixed-size
+/// 4x5 matrix, so that Eigen vectorizes the augmented system.
+/// </summary>
+class DifferentialCorrector
+{
+public:
+	/// <summary>
+	/// State in the first column and the STM in the remaining four columns.
+	/// </summary>
+	using AugmentedState = vtkeigen::Matrix<double, 4, 5>;
+
+	/// <summary>
+	/// Settings of the correction.
+	/// </summary>
+	struct Settings
+	{
+		double stepSize = 1e-3;			// RK4 step size of the augmented system
+		double maxHalfPeriod = 10;		// the search for the half period crossing stops after this time
+		double tolerance = 1e-11;		// largest x-velocity at the half period crossing of a converged orbit
+		int maxIterations = 30;			// largest number of correction iterations
+	};
+
+	/// <summary>
+	/// Computes the initial state of the linearized planar Lyapunov orbit around a collinear Lagrange point.
+	/// </summary>
+	/// <typeparam name="Model">CRTBP model.</typeparam>
+	/// <param name="point">Collinear Lagrange point.</param>
+	/// <param name="amplitude">x-amplitude of the orbit, positive values start on the side away from the Sun.</param>
+	/// <returns>Initial state (x, 0, 0, vy) on the x-axis.</returns>
+	template<typename Model>
+	static Vector4d LyapunovGuess(const Vector2d& point, double amplitude)
+	{
+		// the in-plane center frequency solves (s - Uxx)(s - Uyy) + 4 omega^2 s = 0 for s = -nu^2
+		Matrix2d H = Model::EvalPotential(point, 2).hessian;
+		double w = Model::Omega();
+		double b = 4 * w * w - H(0, 0) - H(1, 1), c = H(0, 0) * H(1, 1);
+		double nu = std::sqrt((b + std::sqrt(b * b - 4 * c)) / 2);
+
+		// x = Ax cos(nu t), y = Ay sin(nu t) with Ay = -(nu^2 + Uxx) Ax / (2 omega nu)
+		double ay = -(nu * nu + H(0, 0)) * amplitude / (2 * w * nu);
+		return Vector4d(point.x() + amplitude, 0, 0, nu * ay);
+	}
+
+	/// <summary>
+	/// Corrects the y-velocity of an initial state on the x-axis until the orbit crosses the x-axis again
+	/// perpendicularly. The x-coordinate is kept fixed.
+	/// </summary>
+	/// <typeparam name="Model">CRTBP model.</typeparam>
+	/// <param name="guess">Initial state (x, 0, 0, vy).</param>
+	/// <param name="settings">Settings of the correction.</param>
+	/// <returns>Corrected orbit, check converged.</returns>
+	template<typename Model>
+	static PeriodicOrbit CorrectLyapunov(const Vector4d& guess, const Settings& settings)
+	{
+		PeriodicOrbit orbit;
+		orbit.state = Vector4d(guess.x(), 0, 0, guess.w());
+		for (orbit.iterations = 0; orbit.iterations < settings.maxIterations; ++orbit.iterations)
+		{
+			AugmentedState half;
+			double t;
+			if (!PropagateToCrossing<Model>(orbit.state, settings, half, t)) return orbit;
+			double vx = half(2, 0);
+			if (std::abs(vx) < settings.tolerance)
+			{
+				orbit.converged = true;
+				orbit.period = 2 * t;
+				break;
+			}
+
+			// first-order change of vx at the crossing, where the crossing time moves with the initial vy
+			Vector4d f = Derivative<Model>(half).col(0);
+			double dvx = half(2, 4) - f[2] * half(1, 4) / f[1];
+			orbit.state.w() -= vx / dvx;
+		}
+		if (!orbit.converged) return orbit;
+
+		orbit.jacobi = Model::JacobiConstant(orbit.state.head<2>(), orbit.state.tail<2>().squaredNorm());
+		orbit.stability = StabilityIndex(Monodromy<Model>(orbit.state, orbit.period, settings.stepSize));
+		return orbit;
+	}
+
+	/// <summary>
+	/// Integrates the state and its STM until the next crossing of the x-axis.
+	/// </summary>
+	/// <typeparam name="Model">CRTBP model.</typeparam>
+	/// <param name="state">Initial state on the x-axis.</param>
+	/// <param name="settings">Step size and time limit.</param>
+	/// <param name="crossing">Receives the state and the STM at the crossing.</param>
+	/// <param name="t">Receives the time of the crossing.</param>
+	/// <returns>False if no crossing was found within the time limit.</returns>
+	template<typename Model>
+	static bool PropagateToCrossing(const Vector4d& state, const Settings& settings, AugmentedState& crossing, double& t)
+	{
+		AugmentedState z = Initial(state);
+		double h = settings.stepSize;
+		z = Step<Model>(z, h);
+		for (t = h; t < settings.maxHalfPeriod; t += h)
+		{
+			AugmentedState next = Step<Model>(z, h);
+			if ((z(1, 0) < 0) != (next(1, 0) < 0))
+			{
+				// Newton iteration on the time within the step, starting from the linear interpolation
+				double tau = h * z(1, 0) / (z(1, 0) - next(1, 0));
+				for (int i = 0; i < 4; ++i)
+				{
+					crossing = Step<Model>(z, tau);
+					tau -= crossing(1, 0) / crossing(3, 0);
+				}
+				crossing = Step<Model>(z, tau);
+				t += tau;
+				return true;
+			}
+			z = next;
+		}
+		return false;
+	}
+
+	/// <summary>
+	/// Integrates the state and its STM over a fixed time with steps of at most the given size.
+	/// </summary>
+	template<typename Model>
+	static AugmentedState Propagate(const Vector4d& state, double time, double stepSize)
+	{
+		int steps = std::max(1, (int)std::ceil(std::abs(time) / stepSize));
+		AugmentedState z = Initial(state);
+		for (int i = 0; i < steps; ++i)
+			z = Step<Model>(z, time / steps);
+		return z;
+	}
+
+	/// <summary>
+	/// Integrates the STM over one period.
+	/// </summary>
+	template<typename Model>
+	static Matrix4d Monodromy(const Vector4d& state, double period, double stepSize)
+	{
+		return Propagate<Model>(state, period, stepSize).template rightCols<4>();
+	}
+
+	/// <summary>
+	/// Computes the stability index (|lambda| + 1 / |lambda|) / 2 from the largest eigenvalue of a monodromy matrix.
+	/// </summary>
+	static double StabilityIndex(const Matrix4d& monodromy)
+	{
+		vtkeigen::EigenSolver<Matrix4d> solver(monodromy, false);
+		double largest = 1;
+		for (int i = 0; i < 4; ++i)
+			largest = std::max(largest, std::abs(solver.eigenvalues()[i]));
+		return (largest + 1 / largest) / 2;
+	}
+
+	/// <summary>
+	/// Performs one classic Runge-Kutta step of the augmented system.
+	/// </summary>
+	template<typename Model>
+	static AugmentedState Step(const AugmentedState& z, double h)
+	{
+		AugmentedState k1 = Derivative<Model>(z);
+		AugmentedState k2 = Derivative<Model>(z + (h / 2.0) * k1);
+		AugmentedState k3 = Derivative<Model>(z + (h / 2.0) * k2);
+		AugmentedState k4 = Derivative<Model>(z + h * k3);
+		return z + (h / 6.0) * (k1 + 2.0 * k2 + 2.0 * k3 + k4);
+	}
+
+	/// <summary>
+	/// Evaluates the equations of motion and the variational equations d/dt STM = A STM with
+	/// A = [0 I; H 2 omega J], where H is the Hessian of the pseudo potential and J = [0 1; -1 0].
+	/// </summary>
+	template<typename Model>
+	static AugmentedState Derivative(const AugmentedState& z)
+	{
+		Vector2d pos(z(0, 0), z(1, 0));
+		PotentialSample p = Model::EvalPotential(pos, 2);
+		double w2 = 2 * Model::Omega();
+
+		Matrix4d A;
+		A << 0, 0, 1, 0,
+			0, 0, 0, 1,
+			p.hessian(0, 0), p.hessian(0, 1), 0, w2,
+			p.hessian(1, 0), p.hessian(1, 1), -w2, 0;
+
+		AugmentedState d;
+		d.col(0) << z(2, 0), z(3, 0), p.grad.x() + w2 * z(3, 0), p.grad.y() - w2 * z(2, 0);
+		d.rightCols<4>().noalias() = A * z.rightCols<4>();
+		return d;
+	}
+
+private:
+	/// <summary>
+	/// Combines a state with the identity STM.
+	/// </summary>
+	static AugmentedState Initial(const Vector4d& state)
+	{
+		AugmentedState z;
+		z.col(0) = state;
+		z.rightCols<4>().setIdentity();
+		return z;
+	}
+};
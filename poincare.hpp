@@ -0,0 +1,298 @@
+#pragma once
+
+#include "integrator.hpp"
+#include "threadpool.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkPolyData.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkPointData.h>
+#include <vtkActor.h>
+#include <vtkProperty.h>
+#include <vtkTextActor.h>
+#include <vtkTextProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Class that computes a Poincaré map on the section y = 0 (crossings with vy > 0) for many seeds at a fixed
+/// Jacobi level. The seeds are integrated in parallel on the shared thread pool and their crossings are
+/// streamed into a point cloud that is drawn in the vertical plane y = 0 at (x, 0, vx).
+/// </summary>
+class PoincareSection
+{
+public:
+	/// <summary>
+	/// Settings of the section computation.
+	/// </summary>
+	struct Settings
+	{
+		int numSeeds = 200;				// number of initial conditions
+		int crossingsPerSeed = 2000;	// number of section crossings recorded per seed
+		double seedRange = 0.35;		// seeds are placed on y = 0 within this distance from the Earth
+		double maxTimePerCrossing = 50;	// a seed stops when it takes longer than this to return to the section
+		double displayScale = 1.0;		// scale of the vx axis in the display
+	};
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	PoincareSection()
+	{
+		mPoints = vtkSmartPointer<vtkPoints>::New();
+		mVerts = vtkSmartPointer<vtkCellArray>::New();
+		mColors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+		mColors->SetName("SeedColor");
+		mColors->SetNumberOfComponents(3);
+
+		mPolyData = vtkSmartPointer<vtkPolyData>::New();
+		mPolyData->SetPoints(mPoints);
+		mPolyData->SetVerts(mVerts);
+		mPolyData->GetPointData()->SetScalars(mColors);
+
+		auto mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+		mapper->SetInputData(mPolyData);
+		mapper->SetColorModeToDirectScalars();
+
+		mActor = vtkSmartPointer<vtkActor>::New();
+		mActor->SetMapper(mapper);
+		mActor->GetProperty()->SetPointSize(2);
+		mActor->GetProperty()->LightingOff();
+
+		mProgress = vtkSmartPointer<vtkTextActor>::New();
+		mProgress->GetTextProperty()->SetFontSize(14);
+		mProgress->GetTextProperty()->SetColor(0.8, 0.8, 0.8);
+		mProgress->SetDisplayPosition(10, 40);
+	}
+
+	/// <summary>
+	/// Destructor. Cancels the running computation.
+	/// </summary>
+	~PoincareSection() { Cancel(); }
+
+	/// <summary>
+	/// Adds the actors to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actors to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		renderer->AddActor(mActor);
+		renderer->AddActor2D(mProgress);
+	}
+
+	/// <summary>
+	/// Gets the settings that are used by the next call to Start().
+	/// </summary>
+	Settings& GetSettings() { return mSettings; }
+
+	/// <summary>
+	/// Discards the current section and starts computing a new one in the background.
+	/// </summary>
+	/// <param name="jacobiLevel">Jacobi constant of all seeds.</param>
+	void Start(double jacobiLevel)
+	{
+		Cancel();
+		Clear();
+
+		auto job = std::make_shared<Job>();
+		mJob = job;
+		Settings settings = mSettings;
+		Vector2d sun = CRTBP::Sun(), earth = CRTBP::Earth();
+		TerminationSettings limits;
+		std::vector<Vector4d> seeds;
+		for (int i = 0; i < settings.numSeeds; ++i)
+		{
+			// seeds on y = 0 with vx = 0; the speed vy > 0 follows from the Jacobi level
+			double x = earth.x() - settings.seedRange + 2 * settings.seedRange * (i + 0.5) / settings.numSeeds;
+
+			// seeds inside a primary would start in the body, and the potential is singular at its center
+			if (std::abs(x - earth.x()) < limits.earthRadius || std::abs(x - sun.x()) < limits.sunRadius) continue;
+			double vy2 = 2 * CRTBP::PseudoPotential(Vector2d(x, 0)) - jacobiLevel;
+			if (vy2 > 0) seeds.push_back(Vector4d(x, 0, 0, std::sqrt(vy2)));
+		}
+		job->numSeeds = (int)seeds.size();
+
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			for (size_t i = 0; i < seeds.size(); ++i)
+			{
+				Vector4d seed = seeds[i];
+				int index = (int)i;
+				ThreadPool::Shared().Submit([job, seed, index, settings] { TraceSeed<Model>(*job, seed, index, settings); });
+			}
+		});
+	}
+
+	/// <summary>
+	/// Stops the background computation. Crossings that were already found stay visible.
+	/// </summary>
+	void Cancel()
+	{
+		if (mJob) mJob->cancelled = true;
+	}
+
+	/// <summary>
+	/// Moves the crossings that were found since the last call into the point cloud and updates the progress.
+	/// </summary>
+	void Update()
+	{
+		if (!mJob) return;
+
+		std::vector<Crossing> crossings;
+		{
+			std::lock_guard<std::mutex> lock(mJob->mutex);
+			crossings.swap(mJob->pending);
+		}
+		if (!crossings.empty())
+		{
+			for (const Crossing& c : crossings)
+			{
+				vtkIdType id = mPoints->InsertNextPoint(c.x, 0.0, c.vx * mSettings.displayScale);
+				mVerts->InsertNextCell(1);
+				mVerts->InsertCellPoint(id);
+				unsigned char rgb[3];
+				SeedColor(c.seed, mJob->numSeeds, rgb);
+				mColors->InsertNextTypedTuple(rgb);
+			}
+			mPoints->Modified();
+			mVerts->Modified();
+			mColors->Modified();
+			mPolyData->Modified();
+		}
+
+		std::string text = "Poincare section y = 0: " + std::to_string(mJob->finished.load()) + " / " + std::to_string(mJob->numSeeds)
+			+ " seeds, " + std::to_string(mPoints->GetNumberOfPoints()) + " crossings";
+		mProgress->SetInput(text.c_str());
+	}
+
+	/// <summary>
+	/// Cancels the computation and clears the section, since it no longer matches the selected CRTBP system.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		Cancel();
+		Clear();
+		mJob.reset();
+		mProgress->SetInput("");
+	}
+
+private:
+	PoincareSection(const PoincareSection&) = delete;		// Delete the copy-constructor.
+	void operator=(const PoincareSection&) = delete;		// Delete the assignment operator.
+
+	/// <summary>
+	/// Crossing of a seed trajectory with the section.
+	/// </summary>
+	struct Crossing
+	{
+		double x, vx;	// coordinates on the section
+		int seed;		// index of the seed
+	};
+
+	/// <summary>
+	/// State that is shared between the scene component and the worker tasks of one computation.
+	/// </summary>
+	struct Job
+	{
+		std::atomic<bool> cancelled{ false };	// set to stop all tasks of this job
+		std::atomic<int> finished{ 0 };			// number of seeds that are done
+		int numSeeds = 0;						// number of seeds in this job
+		std::mutex mutex;						// guards pending
+		std::vector<Crossing> pending;			// crossings that were not yet moved into the point cloud
+	};
+
+	/// <summary>
+	/// Integrates one seed with Dormand-Prince and records its crossings of y = 0 with vy > 0.
+	/// </summary>
+	template<typename Model>
+	static void TraceSeed(Job& job, const Vector4d& seed, int index, const Settings& settings)
+	{
+		IntegratorSettings integrator;
+		integrator.type = IntegratorType::DormandPrince54;
+		integrator.duration = settings.maxTimePerCrossing * settings.crossingsPerSeed;
+
+		std::vector<Event> events = { Event::PlaneCrossing(1, 0.0, +1) };
+		std::vector<Event> terminations = Event::Terminations<Model>(TerminationSettings());
+		events.insert(events.end(), terminations.begin(), terminations.end());
+		std::vector<double> g(events.size());
+		for (size_t i = 0; i < events.size(); ++i)
+			g[i] = events[i].g(0, seed);
+
+		DormandPrince54<Model> stepper(seed, 0.0, integrator);
+		std::vector<EventHit> found;
+		std::vector<Crossing> batch;
+		int crossings = 0;
+		double lastCrossing = 0;
+		while (!stepper.Done() && crossings < settings.crossingsPerSeed && !job.cancelled)
+		{
+			stepper.Step();
+			bool stop = Integrator::DetectEvents(stepper, events, g, found);
+			for (const EventHit& hit : found)
+			{
+				if (hit.event != 0 || crossings >= settings.crossingsPerSeed) continue;
+				batch.push_back(Crossing{ hit.state[0], hit.state[2], index });
+				lastCrossing = hit.t;
+				++crossings;
+			}
+			if (stop || stepper.Time() - lastCrossing > settings.maxTimePerCrossing) break;
+
+			// hand crossings over in batches to keep the lock contention low
+			if (batch.size() >= 64)
+			{
+				std::lock_guard<std::mutex> lock(job.mutex);
+				job.pending.insert(job.pending.end(), batch.begin(), batch.end());
+				batch.clear();
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(job.mutex);
+			job.pending.insert(job.pending.end(), batch.begin(), batch.end());
+		}
+		job.finished++;
+	}
+
+	/// <summary>
+	/// Computes a distinct color for a seed by walking around the hue circle.
+	/// </summary>
+	static void SeedColor(int seed, int numSeeds, unsigned char* rgb)
+	{
+		double h = 6.0 * seed / std::max(numSeeds, 1);
+		double f = h - std::floor(h);
+		double c[6][3] = { {1, f, 0}, {1 - f, 1, 0}, {0, 1, f}, {0, 1 - f, 1}, {f, 0, 1}, {1, 0, 1 - f} };
+		const double* rgbd = c[(int)h % 6];
+		for (int i = 0; i < 3; ++i)
+			rgb[i] = (unsigned char)(55 + 200 * rgbd[i]);
+	}
+
+	/// <summary>
+	/// Removes all points from the point cloud.
+	/// </summary>
+	void Clear()
+	{
+		mPoints->Initialize();
+		mVerts->Initialize();
+		mColors->Initialize();
+		mColors->SetNumberOfComponents(3);
+		mPolyData->Modified();
+	}
+
+	Settings mSettings;								// settings for the next computation
+	std::shared_ptr<Job> mJob;						// running or last computation
+	vtkSmartPointer<vtkPoints> mPoints;				// section crossings at (x, 0, vx)
+	vtkSmartPointer<vtkCellArray> mVerts;			// one vertex per crossing
+	vtkSmartPointer<vtkUnsignedCharArray> mColors;	// color of the seed of each crossing
+	vtkSmartPointer<vtkPolyData> mPolyData;			// point cloud
+	vtkSmartPointer<vtkActor> mActor;				// actor of the point cloud
+	vtkSmartPointer<vtkTextActor> mProgress;		// progress display
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "tracer.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkPolyData.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkActor.h>
+#include <vtkProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+/// <summary>
+/// Class that previews the trajectory that would start at the mouse cursor. The preview is integrated on
+/// the UI thread within a time budget per frame: a coarse pass first extends the trajectory up to the
+/// duration of the tracer, then a fine pass with the integrator settings of the tracer replaces it from the
+/// start. Both passes stop at the same collision and escape events as the tracer. Moving the cursor discards
+/// both passes and starts over at the new position.
+/// </summary>
+class HoverPreview
+{
+public:
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	HoverPreview()
+	{
+		mPoints = vtkSmartPointer<vtkPoints>::New();
+		mLines = vtkSmartPointer<vtkCellArray>::New();
+		mPolyData = vtkSmartPointer<vtkPolyData>::New();
+		mPolyData->SetPoints(mPoints);
+		mPolyData->SetLines(mLines);
+
+		auto mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+		mapper->SetInputData(mPolyData);
+		mapper->ScalarVisibilityOff();
+
+		mActor = vtkSmartPointer<vtkActor>::New();
+		mActor->SetMapper(mapper);
+		mActor->GetProperty()->SetColor(1.0, 0.85, 0.6);
+		mActor->GetProperty()->SetOpacity(0.6);
+		mActor->GetProperty()->SetLineWidth(2);
+		mActor->GetProperty()->LightingOff();
+		mActor->SetPickable(false);
+	}
+
+	/// <summary>
+	/// Adds the actors to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actors to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		renderer->AddActor(mActor);
+	}
+
+	/// <summary>
+	/// Moves the start of the preview. The running preview is aborted.
+	/// </summary>
+	/// <param name="pnt">3D world coordinate under the cursor.</param>
+	/// <param name="integrator">Integrator settings of the tracer, which the fine pass reproduces.</param>
+	void SetTarget(const Vector3d& pnt, const IntegratorSettings& integrator)
+	{
+		if (!mEnabled) return;
+		mIntegrator = integrator;
+		Vector4d state = Tracer::InitialState(Vector2d(pnt.x(), pnt.y()));
+
+		// the coarse pass takes larger steps, or looser tolerances with the adaptive scheme
+		IntegratorSettings coarse = integrator;
+		coarse.stepSize = std::max(integrator.stepSize, CoarseStepSize);
+		coarse.outputInterval = std::max(integrator.outputInterval, CoarseStepSize);
+		coarse.relTol = std::max(integrator.relTol, CoarseTolerance);
+		coarse.absTol = std::max(integrator.absTol, CoarseTolerance);
+		mCoarse.Reset(state, coarse);
+		mFine.Reset(state, integrator);
+		mChanged = true;
+	}
+
+	/// <summary>
+	/// Shows or hides the preview.
+	/// </summary>
+	void Toggle()
+	{
+		mEnabled = !mEnabled;
+		mActor->SetVisibility(mEnabled);
+		mCoarse.done = mFine.done = true;
+	}
+
+	/// <summary>
+	/// Continues the integration of the preview until the time budget of this frame is used up.
+	/// </summary>
+	void Update()
+	{
+		if (mEnabled && !mFine.done)
+		{
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(BudgetMicroseconds);
+			CRTBP::Dispatch([&](auto model)
+			{
+				using Model = decltype(model);
+				mChanged |= Advance<Model>(mCoarse, deadline);
+				if (mCoarse.done)
+					mChanged |= Advance<Model>(mFine, deadline);
+			});
+		}
+		if (mChanged)
+		{
+			UpdateGeometry();
+			mChanged = false;
+		}
+	}
+
+	/// <summary>
+	/// Restarts the preview at its current position in the system selected by CRTBP::SetSystem.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		if (!mCoarse.samples.empty())
+			SetTarget(Vector3d(mCoarse.samples.front().x(), mCoarse.samples.front().y(), 0), mIntegrator);
+	}
+
+private:
+	HoverPreview(const HoverPreview&) = delete;			// Delete the copy-constructor.
+	void operator=(const HoverPreview&) = delete;		// Delete the assignment operator.
+
+	static constexpr double CoarseStepSize = 0.02;		// smallest step size and output interval of the first pass
+	static constexpr double CoarseTolerance = 1e-6;		// loosest tolerances of the first pass with the adaptive scheme
+	static constexpr int BudgetMicroseconds = 4000;		// integration time per frame
+
+	/// <summary>
+	/// Integration pass that resumes where the time budget of the previous frame ended it.
+	/// </summary>
+	struct Pass
+	{
+		IntegratorSettings settings;	// scheme, step size and duration of the whole pass
+		Vector4d state;					// current state
+		double t = 0;					// current time
+		bool done = true;				// the pass reached the duration, collided or escaped
+		std::vector<Vector2d> samples;	// emitted positions
+		std::vector<double> times;		// time of each emitted position
+
+		void Reset(const Vector4d& s, const IntegratorSettings& integrator)
+		{
+			settings = integrator;
+			state = s;
+			t = 0;
+			done = false;
+			samples.assign(1, Vector2d(s[0], s[1]));
+			times.assign(1, 0.0);
+		}
+	};
+
+	/// <summary>
+	/// Advances a pass with Integrator::Integrate until it is done or the deadline passed. The deadline stops the
+	/// integration after a step, and the pass resumes from its last regular output next frame, so that the outputs
+	/// stay on the grid of an uninterrupted integration.
+	/// </summary>
+	/// <returns>True if samples were added.</returns>
+	template<typename Model>
+	static bool Advance(Pass& pass, std::chrono::steady_clock::time_point deadline)
+	{
+		if (pass.done || std::chrono::steady_clock::now() >= deadline) return false;
+
+		std::vector<Event> events = Event::Terminations<Model>(TerminationSettings());
+
+		IntegratorSettings settings = pass.settings;
+		settings.duration = pass.settings.duration - pass.t;
+		size_t numSamples = pass.samples.size();
+		double t0 = pass.t;
+		bool interrupted = false;
+		Integrator::Integrate<Model>(pass.state, settings, [&](double t, const Vector4d& s)
+		{
+			if (t == 0) return;		// the start state was emitted by the previous frame
+			pass.state = s;
+			pass.t = t0 + t;
+			pass.samples.push_back(Vector2d(s[0], s[1]));
+			pass.times.push_back(pass.t);
+		}, events, nullptr, [&] { return interrupted = std::chrono::steady_clock::now() >= deadline; });
+
+		pass.done = !interrupted;
+		return pass.samples.size() != numSamples;
+	}
+
+	/// <summary>
+	/// Rebuilds the polyline from the fine samples, continued by the coarse samples beyond them.
+	/// </summary>
+	void UpdateGeometry()
+	{
+		mPoints->Reset();
+		for (const Vector2d& p : mFine.samples)
+			mPoints->InsertNextPoint(p.x(), p.y(), 0.0);
+		if (!mFine.done)
+		{
+			size_t first = std::upper_bound(mCoarse.times.begin(), mCoarse.times.end(), mFine.t) - mCoarse.times.begin();
+			for (size_t i = first; i < mCoarse.samples.size(); ++i)
+				mPoints->InsertNextPoint(mCoarse.samples[i].x(), mCoarse.samples[i].y(), 0.0);
+		}
+
+		vtkIdType n = mPoints->GetNumberOfPoints();
+		mLines->Reset();
+		mLines->InsertNextCell((int)n);
+		for (vtkIdType i = 0; i < n; ++i)
+			mLines->InsertCellPoint(i);
+		mPoints->Modified();
+		mLines->Modified();
+		mPolyData->Modified();
+	}
+
+	bool mEnabled = true;						// the preview follows the cursor
+	IntegratorSettings mIntegrator;				// integrator settings of the tracer
+	bool mChanged = false;						// the samples changed since the last geometry update
+	Pass mCoarse;								// first pass with the coarse step size
+	Pass mFine;									// second pass with the fine step size
+	vtkSmartPointer<vtkPoints> mPoints;			// vertices of the polyline
+	vtkSmartPointer<vtkCellArray> mLines;		// single polyline cell
+	vtkSmartPointer<vtkPolyData> mPolyData;		// preview geometry
+	vtkSmartPointer<vtkActor> mActor;			// actor of the preview
+};
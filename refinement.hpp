@@ -0,0 +1,316 @@
+#pragma once
+
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+/// <summary>
+/// Rectangular block of nodes of a square scalar map together with their values.
+/// </summary>
+struct ScalarBlock
+{
+	int i0 = 0, j0 = 0;			// first node
+	int ni = 0, nj = 0;			// number of nodes along x and y
+	int stride = 1;				// distance between the nodes of the block in grid nodes
+	std::vector<float> values;	// value of node (NodeI(a), NodeJ(b)) at index b * ni + a, NaN where undefined
+
+	/// <summary>
+	/// Gets the grid index of node a along x. The nodes are i0 + a * stride, except that a block at the border
+	/// of a map ends on its last node, so that no node lies outside the map.
+	/// </summary>
+	int NodeI(int a, int resolution) const { return std::min(i0 + a * stride, resolution - 1); }
+
+	/// <summary>
+	/// Gets the grid index of node b along y, see NodeI().
+	/// </summary>
+	int NodeJ(int b, int resolution) const { return std::min(j0 + b * stride, resolution - 1); }
+};
+
+/// <summary>
+/// Schedules the computation of an expensive scalar map from coarse to fine. The map is first computed on
+/// a coarse grid, then blocks are refined to half their node spacing in the order of the largest value jump
+/// between neighboring nodes, i.e., the local gradient times the node spacing. Blocks whose values vary less
+/// than the tolerance are not refined any further and are shown bilinearly interpolated, so only the
+/// neighborhood of ridges is computed at full resolution. The blocks run on the thread pool; finished blocks
+/// are painted into the image in place by Paint(), which is meant to be called once per frame.
+/// </summary>
+class RefinementScheduler
+{
+public:
+	/// <summary>
+	/// Settings of the refinement.
+	/// </summary>
+	struct Settings
+	{
+		int resolution = 1024;		// number of nodes along x and y at full resolution
+		int blockCells = 16;		// number of cells along x and y of a block
+		int coarseStride = 16;		// node spacing of the coarse grid, a power of two; 1 computes the full resolution right away
+		double tolerance = 0.1;		// blocks whose largest value jump is below this are not refined
+	};
+
+	/// <summary>
+	/// Function that computes the values of the nodes (i0 + a * stride, j0 + b * stride), a < ni, b < nj, where
+	/// the last node is clamped to resolution - 1 (see ScalarBlock::NodeI). It is called concurrently from the
+	/// worker threads.
+	/// </summary>
+	using BlockFunction = std::function<ScalarBlock(int i0, int j0, int ni, int nj, int stride)>;
+
+	/// <summary>
+	/// Constructor. Queues the blocks of the coarse grid.
+	/// </summary>
+	/// <param name="settings">Settings of the refinement.</param>
+	/// <param name="compute">Function that computes a block of the map.</param>
+	/// <param name="pool">Thread pool to run the blocks on.</param>
+	RefinementScheduler(const Settings& settings, BlockFunction compute, ThreadPool& pool = ThreadPool::Shared()) :
+		mState(std::make_shared<State>(settings, std::move(compute), pool))
+	{
+		int span = settings.blockCells * settings.coarseStride;
+		for (int j0 = 0; j0 < settings.resolution - 1; j0 += span)
+			for (int i0 = 0; i0 < settings.resolution - 1; i0 += span)
+				Schedule(mState, Request{ std::numeric_limits<double>::infinity(), i0, j0, settings.coarseStride });
+	}
+
+	/// <summary>
+	/// Destructor. Cancels the blocks that did not start yet.
+	/// </summary>
+	~RefinementScheduler() { Cancel(); }
+
+	/// <summary>
+	/// Cancels the blocks that did not start yet.
+	/// </summary>
+	void Cancel() { mState->cancelled = true; }
+
+	/// <summary>
+	/// Paints the blocks that finished since the last call into an image of resolution x resolution nodes.
+	/// Each block overwrites the area it covers with the bilinear interpolation of its nodes.
+	/// </summary>
+	/// <param name="pixels">Row major image.</param>
+	/// <param name="painted">Optional callback that is called with every painted block.</param>
+	/// <returns>Number of painted blocks.</returns>
+	size_t Paint(float* pixels, const std::function<void(const ScalarBlock&)>& painted = nullptr)
+	{
+		std::vector<ScalarBlock> blocks;
+		{
+			std::lock_guard<std::mutex> lock(mState->mutex);
+			blocks.swap(mState->done);
+		}
+		for (const ScalarBlock& block : blocks)
+		{
+			PaintBlock(block, pixels, mState->settings.resolution);
+			if (painted) painted(block);
+		}
+		return blocks.size();
+	}
+
+	/// <summary>
+	/// Returns true when all blocks are computed.
+	/// </summary>
+	bool Done() const { return mState->outstanding == 0; }
+
+	/// <summary>
+	/// Gets the number of distinct nodes that were computed so far. Nodes that a finer block computes again,
+	/// and the nodes that neighboring blocks share, count once.
+	/// </summary>
+	uint64_t ComputedNodes() const { return mState->computedNodes; }
+
+	/// <summary>
+	/// Gets the number of nodes of the full resolution map.
+	/// </summary>
+	uint64_t TotalNodes() const { return (uint64_t)mState->settings.resolution * mState->settings.resolution; }
+
+	/// <summary>
+	/// Gets the finest node spacing that was reached so far.
+	/// </summary>
+	int FinestStride() const { return mState->finestStride; }
+
+private:
+	RefinementScheduler(const RefinementScheduler&) = delete;	// Delete the copy-constructor.
+	void operator=(const RefinementScheduler&) = delete;		// Delete the assignment operator.
+
+	/// <summary>
+	/// Block that waits for its computation.
+	/// </summary>
+	struct Request
+	{
+		double priority;	// largest value jump of the area in the parent block
+		int i0, j0;			// first node
+		int stride;			// node spacing
+
+		bool operator<(const Request& other) const
+		{
+			// coarser blocks first on ties, so that the coarse grid completes before any refinement
+			return priority < other.priority || (priority == other.priority && stride < other.stride);
+		}
+	};
+
+	/// <summary>
+	/// State that is shared with the worker tasks, which may outlive the scheduler.
+	/// </summary>
+	struct State
+	{
+		State(const Settings& s, BlockFunction f, ThreadPool& p) : settings(s), compute(std::move(f)), pool(p), finestStride(s.coarseStride),
+			computed(((size_t)s.resolution * s.resolution + 63) / 64) {}
+
+		Settings settings;
+		BlockFunction compute;
+		ThreadPool& pool;
+		std::atomic<int> finestStride;				// finest node spacing that was computed so far
+		std::atomic<bool> cancelled{ false };		// set to stop scheduling and computing blocks
+		std::atomic<int> outstanding{ 0 };			// queued or running blocks
+		std::atomic<uint64_t> computedNodes{ 0 };	// number of distinct computed nodes
+		std::vector<std::atomic<uint64_t>> computed;	// one bit per node of the map, set once the node is computed
+		std::mutex mutex;							// guards queue and done
+		std::priority_queue<Request> queue;			// blocks that wait for their computation
+		std::vector<ScalarBlock> done;				// finished blocks that were not painted yet
+	};
+
+	/// <summary>
+	/// Queues a block and submits a task that computes the block with the highest priority at the time it runs.
+	/// </summary>
+	static void Schedule(const std::shared_ptr<State>& state, const Request& request)
+	{
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->queue.push(request);
+		}
+		state->outstanding++;
+		state->pool.Submit([state] { Run(state); });
+	}
+
+	/// <summary>
+	/// Computes the block with the highest priority and queues the refinement of its quadrants.
+	/// </summary>
+	static void Run(const std::shared_ptr<State>& state)
+	{
+		Request request;
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			request = state->queue.top();
+			state->queue.pop();
+		}
+		if (state->cancelled)
+		{
+			state->outstanding--;
+			return;
+		}
+
+		// blocks at the border of the map end on its last node
+		const Settings& s = state->settings;
+		int cells = s.blockCells;
+		int ni = std::min(cells, (s.resolution - 1 - request.i0 + request.stride - 1) / request.stride) + 1;
+		int nj = std::min(cells, (s.resolution - 1 - request.j0 + request.stride - 1) / request.stride) + 1;
+		ScalarBlock block = state->compute(request.i0, request.j0, ni, nj, request.stride);
+		state->computedNodes += CountNew(*state, block);
+		for (int finest = state->finestStride; request.stride < finest && !state->finestStride.compare_exchange_weak(finest, request.stride);) {}
+
+		// queue the quadrants that still vary by more than the tolerance at half the node spacing
+		std::vector<Request> children;
+		if (request.stride > 1)
+		{
+			int half = cells / 2;
+			for (int qb = 0; qb < 2; ++qb)
+				for (int qa = 0; qa < 2; ++qa)
+				{
+					// quadrants past the last node of a border block are empty
+					if (qa * half >= block.ni - 1 || qb * half >= block.nj - 1) continue;
+					double jump = MaxJump(block, qa * half, qb * half, half);
+					int i0 = request.i0 + qa * half * request.stride, j0 = request.j0 + qb * half * request.stride;
+					if (jump > s.tolerance)
+						children.push_back(Request{ jump, i0, j0, request.stride / 2 });
+				}
+		}
+
+		// the block is handed over before its children are queued, so it is always painted before them
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->done.push_back(std::move(block));
+		}
+		if (!state->cancelled)
+			for (const Request& child : children)
+				Schedule(state, child);
+		state->outstanding--;
+	}
+
+	/// <summary>
+	/// Marks the nodes of a block as computed.
+	/// </summary>
+	/// <returns>Number of nodes that were not computed before.</returns>
+	static uint64_t CountNew(State& state, const ScalarBlock& block)
+	{
+		int res = state.settings.resolution;
+		uint64_t count = 0;
+		for (int b = 0; b < block.nj; ++b)
+			for (int a = 0; a < block.ni; ++a)
+			{
+				size_t node = (size_t)block.NodeJ(b, res) * res + block.NodeI(a, res);
+				uint64_t bit = uint64_t(1) << (node % 64);
+				if (!(state.computed[node / 64].fetch_or(bit, std::memory_order_relaxed) & bit))
+					++count;
+			}
+		return count;
+	}
+
+	/// <summary>
+	/// Computes the largest value difference between neighboring nodes in a square of cells of a block.
+	/// Nodes with undefined values are ignored, and so are the cells past the last node of a border block.
+	/// </summary>
+	static double MaxJump(const ScalarBlock& block, int a0, int b0, int cells)
+	{
+		int a1 = std::min(a0 + cells, block.ni - 1), b1 = std::min(b0 + cells, block.nj - 1);
+		double jump = 0;
+		for (int b = b0; b <= b1; ++b)
+			for (int a = a0; a <= a1; ++a)
+			{
+				float v = block.values[b * block.ni + a];
+				if (std::isnan(v)) continue;
+				if (a < a1 && !std::isnan(block.values[b * block.ni + a + 1]))
+					jump = std::max(jump, (double)std::abs(block.values[b * block.ni + a + 1] - v));
+				if (b < b1 && !std::isnan(block.values[(b + 1) * block.ni + a]))
+					jump = std::max(jump, (double)std::abs(block.values[(b + 1) * block.ni + a] - v));
+			}
+		return jump;
+	}
+
+	/// <summary>
+	/// Overwrites the area of a block with the bilinear interpolation of its nodes.
+	/// Pixels next to an undefined node take the value of the nearest node of their cell.
+	/// </summary>
+	static void PaintBlock(const ScalarBlock& block, float* pixels, int resolution)
+	{
+		for (int b = 0; b + 1 < block.nj; ++b)
+			for (int a = 0; a + 1 < block.ni; ++a)
+			{
+				auto node = [&](int da, int db) { return block.values[(b + db) * block.ni + a + da]; };
+				float v00 = node(0, 0), v10 = node(1, 0), v01 = node(0, 1), v11 = node(1, 1);
+				bool defined = !std::isnan(v00) && !std::isnan(v10) && !std::isnan(v01) && !std::isnan(v11);
+
+				// the last cell of a border block may be narrower than the stride
+				int x0 = block.NodeI(a, resolution), x1 = block.NodeI(a + 1, resolution);
+				int y0 = block.NodeJ(b, resolution), y1 = block.NodeJ(b + 1, resolution);
+				for (int y = y0; y <= y1; ++y)
+				{
+					float* row = pixels + (size_t)y * resolution;
+					float ty = (float)(y - y0) / (y1 - y0);
+					for (int x = x0; x <= x1; ++x)
+					{
+						float tx = (float)(x - x0) / (x1 - x0);
+						if (defined)
+							row[x] = (1 - ty) * ((1 - tx) * v00 + tx * v10) + ty * ((1 - tx) * v01 + tx * v11);
+						else
+							row[x] = node(tx < 0.5f ? 0 : 1, ty < 0.5f ? 0 : 1);
+					}
+				}
+			}
+	}
+
+	std::shared_ptr<State> mState;	// state that is shared with the worker tasks
+};
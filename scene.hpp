@@ -4,16 +4,29 @@
 #include "sun.hpp"
 #include "earth.hpp"
 #include "tracer.hpp"
+#include "tracerset.hpp"
 #include "stars.hpp"
 #include "lagrange.hpp"
 #include "jacobi.hpp"
+#include "ensemble.hpp"
+#include "poincare.hpp"
+#include "ftle.hpp"
+#include "preview.hpp"
+#include "particles.hpp"
+#include "family.hpp"
+#include "manifolds.hpp"
+#include "connections.hpp"
 
+#include <algorithm>
 #include <memory>
+#include <string>
 
 #include <vtkRenderer.h>
 #include <vtkSmartPointer.h>
 #include <vtkRenderWindowInteractor.h>
 #include <vtkLight.h>
+#include <vtkTextActor.h>
+#include <vtkTextProperty.h>
 
 /// <summary>
 /// Class that stores all content of the 3D scene.
@@ -30,9 +43,16 @@ public:
 		mEarth(std::make_unique<Earth>()),
 
 		mTracer(std::make_unique<Tracer>()),
+		mTracerSet(std::make_unique<TracerSet>()),
 		mStars(std::make_unique<Stars>()),
 		mLagrangePoints(std::make_unique<LagrangePoints>()),
-		mJacobiConstant(std::make_unique<JacobiConstant>())
+		mJacobiConstant(std::make_unique<JacobiConstant>()),
+		mPoincare(std::make_unique<PoincareSection>()),
+		mFTLE(std::make_unique<FTLELayer>()),
+		mPreview(std::make_unique<HoverPreview>()),
+		mParticles(std::make_unique<ParticleSystem>()),
+		mFamily(std::make_unique<OrbitFamily>()),
+		mManifolds(std::make_unique<InvariantManifolds>())
 	{
 	}
 
@@ -43,7 +63,7 @@ public:
 	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
 	{
 		// 1) Create a point‐light at the sun’s location
-		auto sunLight = vtkSmartPointer<vtkLight>::New();
+		sunLight = vtkSmartPointer<vtkLight>::New();
 		sunLight->SetLightTypeToSceneLight();                // make it a positional light
 		sunLight->SetPosition(
 			CRTBP::Sun().x(),
@@ -60,14 +80,28 @@ public:
 
 		// 4) Add it to the renderer
 		renderer->AddLight(sunLight);
+		// report line of the last ensemble run above the progress lines of the components
+		mReport = vtkSmartPointer<vtkTextActor>::New();
+		mReport->GetTextProperty()->SetFontSize(14);
+		mReport->GetTextProperty()->SetColor(0.8, 0.8, 0.8);
+		mReport->SetDisplayPosition(10, 120);
+		renderer->AddActor2D(mReport);
+
 		// add actors of all scene elements to the renderer
 		mGrid->InitRenderer(renderer);
 		mSun->InitRenderer(renderer);
 		mEarth->InitRenderer(renderer);
 		mTracer->InitRenderer(renderer);
+		mTracerSet->InitRenderer(renderer);
 		mStars->InitRenderer(renderer);
 		mLagrangePoints->InitRenderer(renderer);
 		mJacobiConstant->InitRenderer(renderer);
+		mPoincare->InitRenderer(renderer);
+		mFTLE->InitRenderer(renderer);
+		mPreview->InitRenderer(renderer);
+		mParticles->InitRenderer(renderer);
+		mFamily->InitRenderer(renderer);
+		mManifolds->InitRenderer(renderer);
 	}
 
 	/// <summary>
@@ -88,6 +122,258 @@ public:
 	{
 		mEarth->Update(dt, t * 0.001);
 		mTracer->Update(dt, t * 0.001);
+		mPoincare->Update();
+		mFTLE->Update();
+		mPreview->Update();
+		mParticles->Update();
+		mFamily->Update();
+		mManifolds->Update();
+	}
+
+	/// <summary>
+	/// Selects a CRTBP system and rebuilds all scene elements that depend on it.
+	/// </summary>
+	/// <param name="system">System to switch to.</param>
+	void SetSystem(const CRTBPSystem& system)
+	{
+		CRTBP::SetSystem(system);
+		sunLight->SetPosition(CRTBP::Sun().x(), CRTBP::Sun().y(), 0.0);
+		mSun->OnSystemChanged();
+		mEarth->OnSystemChanged();
+		mLagrangePoints->OnSystemChanged();
+		mJacobiConstant->OnSystemChanged();
+		mTracer->OnSystemChanged();
+		mTracerSet->OnSystemChanged();
+		mPoincare->OnSystemChanged();
+		mFTLE->OnSystemChanged();
+		mPreview->OnSystemChanged();
+		mParticles->OnSystemChanged();
+		mFamily->OnSystemChanged();
+		mManifolds->OnSystemChanged();
+		mPreviousOrbit = PeriodicOrbit();
+		mPreviousCrossings.clear();
+		mReport->SetInput("");
+	}
+
+	/// <summary>
+	/// Switches to the next predefined CRTBP system.
+	/// </summary>
+	void NextSystem()
+	{
+		const auto& presets = CRTBP::Presets();
+		size_t next = 0;
+		for (size_t i = 0; i < presets.size(); ++i)
+			if (presets[i].name == CRTBP::System().name)
+				next = (i + 1) % presets.size();
+		SetSystem(presets[next]);
+	}
+
+	/// <summary>
+	/// Toggles the tracer between fixed step RK4 and adaptive Dormand-Prince integration.
+	/// </summary>
+	void ToggleIntegrator()
+	{
+		bool adaptive = mTracer->GetIntegrator() == IntegratorType::DormandPrince54;
+		mTracer->SetIntegrator(adaptive ? IntegratorType::RK4 : IntegratorType::DormandPrince54);
+	}
+
+	/// <summary>
+	/// Toggles the tracer between the fixed length trajectory and the streaming mode that keeps growing it.
+	/// </summary>
+	void ToggleStreaming()
+	{
+		mTracer->ToggleStreaming();
+	}
+
+	/// <summary>
+	/// Integrates a sweep of trajectories around the last picked point, shows the ensemble throughput in the
+	/// report line and the trajectories colored by the reason why they stopped.
+	/// </summary>
+	/// <param name="numTrajectories">Number of trajectories in the sweep.</param>
+	void RunEnsemble(int numTrajectories = 4096)
+	{
+		// fan of launch angles and start positions around the last pick
+		Vector3d pick = mTracer->GetLastPick();
+		std::vector<Vector4d> initial(numTrajectories);
+		int side = (int)std::ceil(std::sqrt(numTrajectories));
+		for (int i = 0; i < numTrajectories; ++i)
+		{
+			double u = (i % side) / (double)side - 0.5, v = (i / side) / (double)side - 0.5;
+			initial[i] = Tracer::InitialState(Vector2d(pick.x() + 0.02 * u, pick.y() + 0.02 * v), 0.2 * v);
+		}
+
+		EnsembleIntegrator ensemble;
+		EnsembleResult result;
+		ensemble.Integrate(initial, result);
+		std::string text = "Ensemble: " + std::to_string(result.numTrajectories) + " trajectories, "
+			+ std::to_string(result.steps) + " steps in " + std::to_string(result.seconds) + " s ("
+			+ std::to_string((int)result.TrajectoriesPerSecond()) + " trajectories/s, " + std::to_string(ThreadPool::Shared().NumThreads())
+			+ " threads, " + std::to_string((int)(100 * result.LaneUtilization())) + "% lane utilization), "
+			+ std::to_string(result.Count(Termination::SunCollision) + result.Count(Termination::EarthCollision)) + " collisions, "
+			+ std::to_string(result.Count(Termination::Escape)) + " escapes";
+		mReport->SetInput(text.c_str());
+
+		mTracerSet->Clear();
+		for (size_t i = 0; i < result.numTrajectories; ++i)
+		{
+			const double* x = result.x.data() + i * result.samplesPerTrajectory;
+			const double* y = result.y.data() + i * result.samplesPerTrajectory;
+			Vector3d color(0.9, 0.9, 0.9);
+			switch (result.termination[i])
+			{
+			case Termination::SunCollision: color = Vector3d(1.0, 0.6, 0.1); break;
+			case Termination::EarthCollision: color = Vector3d(0.2, 0.8, 0.3); break;
+			case Termination::Escape: color = Vector3d(0.3, 0.5, 1.0); break;
+			default: break;
+			}
+			mTracerSet->Add(result.numSamples[i], [&](size_t j) { return Vector2d(x[j], y[j]); }, color);
+		}
+	}
+
+	/// <summary>
+	/// Starts computing the Poincare section of the y = 0 plane at the Jacobi level of the tracer.
+	/// </summary>
+	void StartPoincareSection()
+	{
+		mPoincare->Start(Tracer::GetJacobiLevel());
+	}
+
+	/// <summary>
+	/// Computes the FTLE field on first use, afterwards toggles its visibility.
+	/// </summary>
+	void ToggleFTLE()
+	{
+		mFTLE->Toggle();
+	}
+
+	/// <summary>
+	/// Shows or hides the trajectory preview under the cursor.
+	/// </summary>
+	void TogglePreview()
+	{
+		mPreview->Toggle();
+	}
+
+	/// <summary>
+	/// Starts the particle animation on first use, afterwards pauses or resumes it.
+	/// </summary>
+	void ToggleParticles()
+	{
+		mParticles->Toggle();
+	}
+
+	/// <summary>
+	/// Starts the continuation of the planar Lyapunov family around L1 or L2.
+	/// </summary>
+	/// <param name="index">Index of the Lagrange point, 0 for L1 and 1 for L2.</param>
+	void ComputeFamily(int index)
+	{
+		mFamily->Start(mLagrangePoints->GetPoints()[index], index == 0 ? "L1" : "L2");
+	}
+
+	/// <summary>
+	/// Starts computing the stable and unstable manifolds of the family orbit whose Jacobi constant is closest
+	/// to the level of the tracer. If the manifolds of that orbit are shown already, the next closest orbit is
+	/// taken, so that repeated calls alternate between two orbits. Complete manifolds are kept as those of the
+	/// previous orbit for FindConnections.
+	/// </summary>
+	void ComputeManifolds()
+	{
+		const std::vector<PeriodicOrbit>& family = mFamily->GetFamily();
+		if (family.empty())
+		{
+			mReport->SetInput("Manifolds: compute a Lyapunov family first");
+			return;
+		}
+		mReport->SetInput("");
+		std::vector<const PeriodicOrbit*> members;
+		for (const PeriodicOrbit& orbit : family)
+			members.push_back(&orbit);
+		std::sort(members.begin(), members.end(), [](const PeriodicOrbit* a, const PeriodicOrbit* b)
+		{
+			return std::abs(a->jacobi - Tracer::GetJacobiLevel()) < std::abs(b->jacobi - Tracer::GetJacobiLevel());
+		});
+		const PeriodicOrbit* orbit = members.front();
+		if (SameOrbit(*orbit, mManifolds->GetOrbit()) && members.size() > 1)
+			orbit = members[1];
+
+		// a running, cancelled or failed computation has only part of the crossings
+		if (mManifolds->IsComplete())
+		{
+			mPreviousOrbit = mManifolds->GetOrbit();
+			mPreviousCrossings = mManifolds->GetCrossings();
+			mPreviousSectionX = mManifolds->GetSectionX();
+		}
+		mManifolds->Start(*orbit);
+	}
+
+	/// <summary>
+	/// Searches connections between the manifolds of the previous and the current orbit on their shared section:
+	/// unstable crossings of one orbit that nearly meet stable crossings of the other. Shows the best candidates
+	/// in the report line.
+	/// </summary>
+	void FindConnections()
+	{
+		const std::vector<ManifoldCrossing>& current = mManifolds->GetCrossings();
+		if (!mManifolds->IsComplete())
+		{
+			mReport->SetInput("Connections: wait until the manifolds of the current orbit are complete");
+			return;
+		}
+		if (mPreviousCrossings.empty() || current.empty() || mPreviousSectionX != mManifolds->GetSectionX())
+		{
+			mReport->SetInput("Connections: compute the manifolds of two orbits on the same section first");
+			return;
+		}
+		if (SameOrbit(mPreviousOrbit, mManifolds->GetOrbit()))
+		{
+			mReport->SetInput("Connections: the previous and the current orbit are the same, compute the manifolds of another orbit");
+			return;
+		}
+
+		auto select = [](const std::vector<ManifoldCrossing>& crossings, ManifoldType type, std::vector<const ManifoldCrossing*>& selected)
+		{
+			std::vector<Vector2d> points;
+			for (const ManifoldCrossing& c : crossings)
+				if (c.type == type)
+				{
+					points.push_back(Vector2d(c.state[1], c.state[3]));
+					selected.push_back(&c);
+				}
+			return points;
+		};
+		ConnectionSearch::Settings settings;
+		std::string text;
+		for (int forward = 0; forward < 2; ++forward)
+		{
+			const auto& from = forward ? mPreviousCrossings : current;
+			const auto& to = forward ? current : mPreviousCrossings;
+			std::vector<const ManifoldCrossing*> departing, arriving;
+			std::vector<Vector2d> departingPoints = select(from, ManifoldType::Unstable, departing);
+			std::vector<Vector2d> arrivingPoints = select(to, ManifoldType::Stable, arriving);
+			std::vector<Connection> connections = ConnectionSearch::Find(departingPoints, arrivingPoints, settings);
+
+			if (forward) text += "\n";
+			text += std::string("Connections from the ") + (forward ? "previous" : "current") + " orbit: " + std::to_string(connections.size())
+				+ " candidates among " + std::to_string(departing.size()) + " x " + std::to_string(arriving.size()) + " crossings";
+			for (size_t i = 0; i < std::min<size_t>(connections.size(), 5); ++i)
+			{
+				const ManifoldCrossing& d = *departing[connections[i].departing];
+				const ManifoldCrossing& a = *arriving[connections[i].arriving];
+				text += "\n  mismatch " + std::to_string(connections[i].mismatch) + ", delta vx " + std::to_string(a.state[2] - d.state[2])
+					+ ", seeds " + std::to_string(d.seed) + " -> " + std::to_string(a.seed) + ", time " + std::to_string(d.time - a.time);
+			}
+		}
+		mReport->SetInput(text.c_str());
+	}
+
+	/// <summary>
+	/// Event handler that is called when the cursor moved over the world coordinate pnt.
+	/// </summary>
+	/// <param name="pnt">3D world coordinate under the cursor.</param>
+	void Hover(const Vector3d& pnt)
+	{
+		mPreview->SetTarget(pnt, mTracer->GetIntegratorSettings());
 	}
 
 	/// <summary>
@@ -103,11 +389,31 @@ private:
 	Scene(const Scene&) = delete;						// Delete the copy-constructor.
 	void operator=(const Scene&) = delete;				// Delete the assignment operator.
 
+	/// <summary>
+	/// Checks whether two orbits are the same member of a family.
+	/// </summary>
+	static bool SameOrbit(const PeriodicOrbit& a, const PeriodicOrbit& b)
+	{
+		return a.state == b.state && a.period == b.period;
+	}
+
 	std::unique_ptr<Grid> mGrid;						// a reference grid to provide spatial context
 	std::unique_ptr<Sun> mSun;							// First massive body: Sun
 	std::unique_ptr<Earth> mEarth;						// Second massive body: Earth
 	std::unique_ptr<Tracer> mTracer;
+	std::unique_ptr<TracerSet> mTracerSet;				// All trajectories of the last ensemble in one actor.
 	std::unique_ptr<Stars> mStars;
 	std::unique_ptr<LagrangePoints> mLagrangePoints;
 	std::unique_ptr<JacobiConstant> mJacobiConstant;					// Tracer for the third body with marginal mass.
+	std::unique_ptr<PoincareSection> mPoincare;		// Poincare section of the y = 0 plane.
+	std::unique_ptr<FTLELayer> mFTLE;					// Finite-time Lyapunov exponent field.
+	std::unique_ptr<HoverPreview> mPreview;			// Preview of the trajectory under the cursor.
+	std::unique_ptr<ParticleSystem> mParticles;		// Test bodies advected by the flow.
+	std::unique_ptr<OrbitFamily> mFamily;				// Family of Lyapunov orbits around L1 or L2.
+	std::unique_ptr<InvariantManifolds> mManifolds;	// Stable and unstable manifolds of a family orbit.
+	PeriodicOrbit mPreviousOrbit;						// Orbit whose complete manifolds were computed before the current ones.
+	std::vector<ManifoldCrossing> mPreviousCrossings;	// Section crossings of the manifolds of the previous orbit.
+	double mPreviousSectionX = 0;						// Section of the manifolds of the previous orbit.
+	vtkSmartPointer<vtkLight> sunLight;					// Point light at the position of the Sun.
+	vtkSmartPointer<vtkTextActor> mReport;				// Report of the last ensemble run or scene command.
 };
\ No newline at end of file
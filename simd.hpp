@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/// <summary>
+/// Thin wrapper around the widest double-precision SIMD register that is enabled at compile time
+/// (AVX-512: 8 lanes, AVX2: 4 lanes, otherwise a single scalar lane).
+/// The instruction set is selected with the SCIVIS_SIMD option in CMakeLists.txt.
+/// </summary>
+struct PackD
+{
+#if defined(__AVX512F__)
+	static constexpr int Width = 8;
+	using Register = __m512d;
+#elif defined(__AVX2__)
+	static constexpr int Width = 4;
+	using Register = __m256d;
+#else
+	static constexpr int Width = 1;
+	using Register = double;
+#endif
+
+	Register v;
+
+	PackD() = default;
+	PackD(Register r) : v(r) {}
+
+#if defined(__AVX512F__)
+	static PackD Load(const double* p) { return _mm512_loadu_pd(p); }
+	static PackD Broadcast(double s) { return _mm512_set1_pd(s); }
+	void Store(double* p) const { _mm512_storeu_pd(p, v); }
+	friend PackD operator+(PackD a, PackD b) { return _mm512_add_pd(a.v, b.v); }
+	friend PackD operator-(PackD a, PackD b) { return _mm512_sub_pd(a.v, b.v); }
+	friend PackD operator*(PackD a, PackD b) { return _mm512_mul_pd(a.v, b.v); }
+	friend PackD operator/(PackD a, PackD b) { return _mm512_div_pd(a.v, b.v); }
+	static PackD Sqrt(PackD a) { return _mm512_sqrt_pd(a.v); }
+	static PackD Min(PackD a, PackD b) { return _mm512_min_pd(a.v, b.v); }
+	static PackD Max(PackD a, PackD b) { return _mm512_max_pd(a.v, b.v); }
+#elif defined(__AVX2__)
+	static PackD Load(const double* p) { return _mm256_loadu_pd(p); }
+	static PackD Broadcast(double s) { return _mm256_set1_pd(s); }
+	void Store(double* p) const { _mm256_storeu_pd(p, v); }
+	friend PackD operator+(PackD a, PackD b) { return _mm256_add_pd(a.v, b.v); }
+	friend PackD operator-(PackD a, PackD b) { return _mm256_sub_pd(a.v, b.v); }
+	friend PackD operator*(PackD a, PackD b) { return _mm256_mul_pd(a.v, b.v); }
+	friend PackD operator/(PackD a, PackD b) { return _mm256_div_pd(a.v, b.v); }
+	static PackD Sqrt(PackD a) { return _mm256_sqrt_pd(a.v); }
+	static PackD Min(PackD a, PackD b) { return _mm256_min_pd(a.v, b.v); }
+	static PackD Max(PackD a, PackD b) { return _mm256_max_pd(a.v, b.v); }
+#else
+	static PackD Load(const double* p) { return *p; }
+	static PackD Broadcast(double s) { return s; }
+	void Store(double* p) const { *p = v; }
+	friend PackD operator+(PackD a, PackD b) { return a.v + b.v; }
+	friend PackD operator-(PackD a, PackD b) { return a.v - b.v; }
+	friend PackD operator*(PackD a, PackD b) { return a.v * b.v; }
+	friend PackD operator/(PackD a, PackD b) { return a.v / b.v; }
+	static PackD Sqrt(PackD a) { return std::sqrt(a.v); }
+	static PackD Min(PackD a, PackD b) { return a.v < b.v ? a.v : b.v; }
+	static PackD Max(PackD a, PackD b) { return a.v > b.v ? a.v : b.v; }
+#endif
+
+	/// <summary>
+	/// Reciprocal square root from the hardware estimate, refined by Newton-Raphson iterations
+	/// y' = y * (1.5 - 0.5 * a * y * y) until it reaches double precision.
+	/// The result is within 2 ulp of 1 / sqrt(a) for a in the normal float range [1e-37, 1e37].
+	/// </summary>
+	/// <param name="a">Positive argument.</param>
+	/// <returns>Approximation of 1 / sqrt(a).</returns>
+	static PackD RSqrt(PackD a)
+	{
+#if defined(__AVX512F__)
+		// 14-bit estimate, two iterations give ~52 bits
+		PackD y = _mm512_rsqrt14_pd(a.v);
+		y = Refine(a, y);
+		return Refine(a, y);
+#elif defined(__AVX2__)
+		// 12-bit single-precision estimate, three iterations give ~52 bits
+		PackD y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(a.v)));
+		y = Refine(a, y);
+		y = Refine(a, y);
+		return Refine(a, y);
+#else
+		return 1.0 / std::sqrt(a.v);
+#endif
+	}
+
+private:
+	static PackD Refine(PackD a, PackD y)
+	{
+		PackD half = Broadcast(0.5), threeHalves = Broadcast(1.5);
+		return y * (threeHalves - half * a * y * y);
+	}
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "threadpool.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkFloatArray.h>
+#include <vtkIdTypeArray.h>
+#include <vtkCellArray.h>
+#include <vtkPolyData.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+/// <summary>
+/// Isocontour extraction on a 2D scalar grid that only visits the blocks crossing the isovalue. The grid is
+/// split into blocks of cells, and the value range [min, max] of each block is indexed in span space: the
+/// blocks are sorted by min into bins of equal size, and each bin is sorted by max in descending order. A query
+/// walks every bin whose mins are all below the isovalue only while the max is above it, so it costs one step
+/// per bin plus one per active block. The active blocks are contoured by marching squares on the thread pool.
+/// The index is built once per field and reused for all isovalues.
+/// </summary>
+class SpanSpaceContour
+{
+public:
+	/// <summary>
+	/// Builds the index of a field. The field is referenced, not copied, and must outlive the index.
+	/// </summary>
+	/// <param name="field">Row-major samples, nx per row.</param>
+	/// <param name="nx">Number of samples along x.</param>
+	/// <param name="ny">Number of samples along y.</param>
+	/// <param name="blockSize">Cells per block along both axes.</param>
+	void Build(const double* field, int nx, int ny, int blockSize = 16)
+	{
+		mField = field;
+		mNx = nx;
+		mNy = ny;
+		mBlockSize = blockSize;
+		mBlocksX = std::max(0, (nx - 2) / blockSize + 1);
+		mBlocksY = std::max(0, (ny - 2) / blockSize + 1);
+		size_t numBlocks = (size_t)mBlocksX * mBlocksY;
+
+		// value range of each block, including the samples it shares with its neighbors
+		mMin.resize(numBlocks);
+		mMax.resize(numBlocks);
+		ThreadPool::Shared().ParallelFor(0, mBlocksY, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t by = begin; by < end; ++by)
+				for (int bx = 0; bx < mBlocksX; ++bx)
+				{
+					int x0 = bx * blockSize, x1 = std::min(x0 + blockSize, nx - 1);
+					int y0 = (int)by * blockSize, y1 = std::min(y0 + blockSize, ny - 1);
+					double lo = field[(size_t)y0 * nx + x0], hi = lo;
+					for (int y = y0; y <= y1; ++y)
+					{
+						const double* row = field + (size_t)y * nx;
+						for (int x = x0; x <= x1; ++x)
+						{
+							lo = std::min(lo, row[x]);
+							hi = std::max(hi, row[x]);
+						}
+					}
+					mMin[by * mBlocksX + bx] = lo;
+					mMax[by * mBlocksX + bx] = hi;
+				}
+		});
+
+		// blocks by min in bins of about sqrt(n), each bin by max in descending order
+		mOrder.resize(numBlocks);
+		std::iota(mOrder.begin(), mOrder.end(), 0u);
+		std::sort(mOrder.begin(), mOrder.end(), [&](uint32_t a, uint32_t b) { return mMin[a] < mMin[b]; });
+		size_t binSize = std::max<size_t>(1, (size_t)std::sqrt((double)numBlocks));
+		size_t numBins = (numBlocks + binSize - 1) / binSize;
+		mBinStart.resize(numBins + 1);
+		mBinLargestMin.resize(numBins);
+		for (size_t b = 0; b <= numBins; ++b)
+			mBinStart[b] = std::min(b * binSize, numBlocks);
+		ThreadPool::Shared().ParallelFor(0, numBins, 16, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				mBinLargestMin[b] = mMin[mOrder[mBinStart[b + 1] - 1]];
+				std::sort(mOrder.begin() + mBinStart[b], mOrder.begin() + mBinStart[b + 1],
+					[&](uint32_t x, uint32_t y) { return mMax[x] > mMax[y]; });
+			}
+		});
+	}
+
+	/// <summary>
+	/// Finds the blocks whose value range contains an isovalue.
+	/// </summary>
+	/// <param name="value">Isovalue.</param>
+	/// <param name="blocks">Receives the indices of the active blocks.</param>
+	void ActiveBlocks(double value, std::vector<uint32_t>& blocks) const
+	{
+		blocks.clear();
+		size_t numBins = mBinLargestMin.size();
+		size_t full = std::lower_bound(mBinLargestMin.begin(), mBinLargestMin.end(), value, std::less_equal<double>()) - mBinLargestMin.begin();
+		for (size_t b = 0; b < full; ++b)
+			for (size_t i = mBinStart[b]; i < mBinStart[b + 1] && mMax[mOrder[i]] >= value; ++i)
+				blocks.push_back(mOrder[i]);
+
+		// the first bin with mins above the isovalue may still hold some blocks with smaller mins
+		if (full < numBins)
+			for (size_t i = mBinStart[full]; i < mBinStart[full + 1] && mMax[mOrder[i]] >= value; ++i)
+				if (mMin[mOrder[i]] <= value)
+					blocks.push_back(mOrder[i]);
+	}
+
+	/// <summary>
+	/// Extracts the isocontour as line segments by marching squares over the active blocks.
+	/// </summary>
+	/// <param name="value">Isovalue.</param>
+	/// <param name="origin">World position of the first sample.</param>
+	/// <param name="spacing">Distance of the samples along x and y.</param>
+	/// <param name="output">Receives the points and the line cells, one cell per segment.</param>
+	/// <returns>Number of active blocks.</returns>
+	size_t Extract(double value, const double origin[2], const double spacing[2], vtkPolyData* output) const
+	{
+		std::vector<uint32_t> blocks;
+		ActiveBlocks(value, blocks);
+
+		// segment endpoints (x0, y0, x1, y1) of each active block, in the order of the blocks
+		std::vector<std::vector<float>> segments(blocks.size());
+		ThreadPool::Shared().ParallelFor(0, blocks.size(), 8, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				March(blocks[i], value, origin, spacing, segments[i]);
+		});
+
+		size_t numSegments = 0;
+		for (const auto& s : segments) numSegments += s.size() / 4;
+		auto coords = vtkSmartPointer<vtkFloatArray>::New();
+		coords->SetNumberOfComponents(3);
+		coords->SetNumberOfTuples((vtkIdType)(2 * numSegments));
+		auto offsets = vtkSmartPointer<vtkIdTypeArray>::New();
+		offsets->SetNumberOfValues((vtkIdType)(numSegments + 1));
+		auto connectivity = vtkSmartPointer<vtkIdTypeArray>::New();
+		connectivity->SetNumberOfValues((vtkIdType)(2 * numSegments));
+
+		float* p = coords->GetPointer(0);
+		vtkIdType* o = offsets->GetPointer(0);
+		vtkIdType* c = connectivity->GetPointer(0);
+		vtkIdType id = 0;
+		for (const auto& s : segments)
+			for (size_t k = 0; k < s.size(); k += 4, id += 2)
+			{
+				p[0] = s[k]; p[1] = s[k + 1]; p[2] = 0.0f;
+				p[3] = s[k + 2]; p[4] = s[k + 3]; p[5] = 0.0f;
+				p += 6;
+				*o++ = id;
+				*c++ = id;
+				*c++ = id + 1;
+			}
+		*o = id;
+
+		auto points = vtkSmartPointer<vtkPoints>::New();
+		points->SetData(coords);
+		auto lines = vtkSmartPointer<vtkCellArray>::New();
+		lines->SetData(offsets, connectivity);
+		output->Initialize();
+		output->SetPoints(points);
+		output->SetLines(lines);
+		return blocks.size();
+	}
+
+	size_t NumBlocks() const { return mMin.size(); }	// number of blocks in the index
+
+private:
+	/// <summary>
+	/// Runs marching squares over the cells of one block and appends the segments.
+	/// </summary>
+	void March(uint32_t block, double value, const double origin[2], const double spacing[2], std::vector<float>& segments) const
+	{
+		int bx = block % mBlocksX, by = block / mBlocksX;
+		int x0 = bx * mBlockSize, x1 = std::min(x0 + mBlockSize, mNx - 1);
+		int y0 = by * mBlockSize, y1 = std::min(y0 + mBlockSize, mNy - 1);
+		for (int y = y0; y < y1; ++y)
+		{
+			const double* row = mField + (size_t)y * mNx;
+			const double* next = row + mNx;
+			for (int x = x0; x < x1; ++x)
+			{
+				// corners counterclockwise from the lower left
+				double v[4] = { row[x], row[x + 1], next[x + 1], next[x] };
+				int code = (v[0] > value) | (v[1] > value) << 1 | (v[2] > value) << 2 | (v[3] > value) << 3;
+				if (code == 0 || code == 15) continue;
+
+				// crossing on edge e between corner e and corner e + 1
+				auto crossing = [&](int e, float* out)
+				{
+					static const int cx[4] = { 0, 1, 1, 0 }, cy[4] = { 0, 0, 1, 1 };
+					int a = e, b = (e + 1) & 3;
+					double t = (value - v[a]) / (v[b] - v[a]);
+					out[0] = (float)(origin[0] + (x + cx[a] + t * (cx[b] - cx[a])) * spacing[0]);
+					out[1] = (float)(origin[1] + (y + cy[a] + t * (cy[b] - cy[a])) * spacing[1]);
+				};
+				auto segment = [&](int e0, int e1)
+				{
+					float s[4];
+					crossing(e0, s);
+					crossing(e1, s + 2);
+					segments.insert(segments.end(), s, s + 4);
+				};
+
+				// edges crossed by each case, the saddles are resolved by the value at the cell center
+				switch (code)
+				{
+				case 1: case 14: segment(3, 0); break;
+				case 2: case 13: segment(0, 1); break;
+				case 3: case 12: segment(3, 1); break;
+				case 4: case 11: segment(1, 2); break;
+				case 6: case 9: segment(0, 2); break;
+				case 7: case 8: segment(2, 3); break;
+				case 5: case 10:
+				{
+					bool centerAbove = (v[0] + v[1] + v[2] + v[3]) / 4 > value;
+					if ((code == 5) == centerAbove) { segment(0, 1); segment(2, 3); }
+					else { segment(3, 0); segment(1, 2); }
+					break;
+				}
+				}
+			}
+		}
+	}
+
+	const double* mField = nullptr;			// referenced samples
+	int mNx = 0, mNy = 0;					// number of samples along x and y
+	int mBlockSize = 16;					// cells per block along both axes
+	int mBlocksX = 0, mBlocksY = 0;			// number of blocks along x and y
+	std::vector<double> mMin, mMax;			// value range of each block
+	std::vector<uint32_t> mOrder;			// blocks by min, within each bin by descending max
+	std::vector<size_t> mBinStart;			// first position of each bin in mOrder, followed by the end
+	std::vector<double> mBinLargestMin;		// largest min of each bin, ascending
+};
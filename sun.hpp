@@ -130,6 +130,15 @@ public:
 		renderer->AddVolume(volumeActor);
 	}
 
+	/// <summary>
+	/// Moves the Sun to its position in the system selected by CRTBP::SetSystem.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		mActor->SetPosition(CRTBP::Sun().x(), CRTBP::Sun().y(), 0);
+		volumeActor->SetPosition(CRTBP::Sun().x(), CRTBP::Sun().y(), 0);
+	}
+
 private:
 	Sun(const Sun&) = delete; // Delete the copy-constructor.
 	void operator=(const Sun&) = delete;
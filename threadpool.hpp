@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Work-stealing thread pool. Every worker owns a task deque: it pops its own tasks from the back
+/// and steals from the front of the other deques when it runs dry.
+/// </summary>
+class ThreadPool
+{
+public:
+	/// <summary>
+	/// Constructor. Starts the worker threads.
+	/// </summary>
+	/// <param name="numThreads">Number of worker threads, defaults to the number of hardware threads.</param>
+	explicit ThreadPool(unsigned numThreads = std::max(1u, std::thread::hardware_concurrency()))
+	{
+		for (unsigned i = 0; i < numThreads; ++i)
+			mQueues.push_back(std::make_unique<Queue>());
+		for (unsigned i = 0; i < numThreads; ++i)
+			mThreads.emplace_back([this, i] { WorkerLoop(i); });
+	}
+
+	/// <summary>
+	/// Destructor. Finishes the queued tasks and joins the worker threads.
+	/// </summary>
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mWakeMutex);
+			mStop = true;
+		}
+		mWake.notify_all();
+		for (auto& thread : mThreads)
+			thread.join();
+	}
+
+	/// <summary>
+	/// Gets the pool that is shared by all scene components.
+	/// </summary>
+	/// <returns>Shared thread pool.</returns>
+	static ThreadPool& Shared()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	/// <summary>
+	/// Gets the number of worker threads.
+	/// </summary>
+	unsigned NumThreads() const { return (unsigned)mThreads.size(); }
+
+	/// <summary>
+	/// Enqueues a task. Tasks submitted from a worker go to its own deque, others are distributed round robin.
+	/// </summary>
+	/// <param name="task">Task to run on a worker thread.</param>
+	void Submit(std::function<void()> task)
+	{
+		size_t index = tWorker >= 0 && tPool == this ? (size_t)tWorker : mNextQueue++ % mQueues.size();
+		{
+			std::lock_guard<std::mutex> lock(mQueues[index]->mutex);
+			mQueues[index]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(mWakeMutex);
+			++mPending;
+		}
+		mWake.notify_one();
+	}
+
+	/// <summary>
+	/// Calls f(begin, end) for chunks of [begin, end) in parallel and blocks until all chunks are done.
+	/// The calling thread processes chunks as well, so the call completes even if all workers are busy.
+	/// </summary>
+	/// <param name="begin">First index.</param>
+	/// <param name="end">One past the last index.</param>
+	/// <param name="grain">Number of indices per chunk.</param>
+	/// <param name="f">Callable f(size_t chunkBegin, size_t chunkEnd).</param>
+	template<typename F>
+	void ParallelFor(size_t begin, size_t end, size_t grain, F&& f)
+	{
+		if (end <= begin) return;
+		grain = std::max<size_t>(grain, 1);
+		size_t numChunks = (end - begin + grain - 1) / grain;
+
+		// helpers may still run after this call returned, so they only hold shared state
+		struct Shared
+		{
+			std::atomic<size_t> next{ 0 };
+			std::atomic<size_t> done{ 0 };
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+		auto shared = std::make_shared<Shared>();
+		auto body = [shared, begin, end, grain, numChunks, &f]
+		{
+			for (size_t c; (c = shared->next++) < numChunks;)
+			{
+				size_t b = begin + c * grain;
+				f(b, std::min(end, b + grain));
+				if (++shared->done == numChunks)
+				{
+					std::lock_guard<std::mutex> lock(shared->mutex);
+					shared->finished.notify_all();
+				}
+			}
+		};
+
+		size_t numHelpers = std::min<size_t>(NumThreads(), numChunks - 1);
+		for (size_t i = 0; i < numHelpers; ++i)
+			Submit(body);
+		body();
+
+		std::unique_lock<std::mutex> lock(shared->mutex);
+		shared->finished.wait(lock, [&] { return shared->done == numChunks; });
+	}
+
+private:
+	ThreadPool(const ThreadPool&) = delete;				// Delete the copy-constructor.
+	void operator=(const ThreadPool&) = delete;			// Delete the assignment operator.
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	/// <summary>
+	/// Takes a task from the own deque or steals one from another worker.
+	/// </summary>
+	bool TryPop(size_t self, std::function<void()>& task)
+	{
+		for (size_t i = 0; i < mQueues.size(); ++i)
+		{
+			Queue& queue = *mQueues[(self + i) % mQueues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) continue;
+			if (i == 0)
+			{
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else
+			{
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void WorkerLoop(size_t self)
+	{
+		tWorker = (int)self;
+		tPool = this;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mWakeMutex);
+				mWake.wait(lock, [this] { return mStop || mPending > 0; });
+				if (mPending == 0) return;		// stopped and drained
+				--mPending;
+			}
+			std::function<void()> task;
+			while (!TryPop(self, task))
+				std::this_thread::yield();	// a task was announced but is still being pushed
+			task();
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> mQueues;	// one task deque per worker
+	std::vector<std::thread> mThreads;				// worker threads
+	std::atomic<size_t> mNextQueue{ 0 };			// round robin counter for external submissions
+	std::mutex mWakeMutex;							// guards mPending and mStop
+	std::condition_variable mWake;					// signals new tasks or shutdown
+	size_t mPending = 0;							// number of queued tasks that no worker has claimed yet
+	bool mStop = false;								// set when the pool shuts down
+
+	static inline thread_local int tWorker = -1;				// index of the worker running on this thread
+	static inline thread_local ThreadPool* tPool = nullptr;	// pool that owns this worker thread
+};
@@ -1,7 +1,11 @@
 #pragma once
 
-#include "crtbp.hpp"
+#include "integrator.hpp"
+#include "threadpool.hpp"
+#include "trajectorycache.hpp"
 #include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
 #include <vtkPolyData.h>
 #include <vtkPolyDataMapper.h>
 #include <vtkActor.h>
@@ -9,6 +13,25 @@
 #include <vtkTubeFilter.h>
 #include <vtkFloatArray.h>
 #include <vtkPointData.h>
+#include <vtkIdTypeArray.h>
+#include <vtkShaderProperty.h>
+#include <vtkUniforms.h>
+#include <vtkCamera.h>
+#include <vtkCommand.h>
+#include <vtkTextActor.h>
+#include <vtkTextProperty.h>
+#include <vtkRenderer.h>
+#include <vtkMath.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+
 /// <summary>
 /// Class that represents the third body.
 /// </summary>
@@ -16,8 +39,17 @@ class Tracer
 {
 private:
 	static constexpr double MaxRadius = 0.01;				// max radius of the tube
+	static constexpr double MinRadius = 0.002;				// min radius of the tube
 	static constexpr int NumIntegrationSteps = 1000;		// number of integration steps
 	static constexpr double IntegrationStepSize = 0.005;		// integration step size
+	//static constexpr double JacobiLevel = 3.1396645;		// This is your yellow isoline
+	static constexpr double JacobiLevel = 3.139855;			// Jacobi constant of the picked trajectories
+	static constexpr double LaunchAngle = -0.008;			// try between 0.005 and 0.015 radians
+	static constexpr int StreamStepsPerUpdate = 1000;		// integrator outputs appended per Update in streaming mode
+	static constexpr int StreamChunkPoints = 1 << 14;		// points per chunk of the streamed trajectory
+	static constexpr double DecimationPixels = 0.5;			// largest deviation of the tube centerline from the trajectory in pixels
+	static constexpr double DecimationSpeedError = 0.05;	// largest relative error of the speed interpolated along the tube centerline
+	static constexpr double DefaultTolerance = 1e-3;		// deviation in world units as long as the camera is unknown
 
 	// Step 1: vtkPolyData to store the trajectory
 	vtkSmartPointer<vtkPolyData> trajectory;
@@ -28,8 +60,56 @@ private:
 	// Step 3: Actor
 	vtkSmartPointer<vtkActor> trajectoryActor;
 
-	vtkSmartPointer<vtkTubeFilter> tubeFilter;
-	vtkSmartPointer<vtkFloatArray> radiusArray;
+	double pulsePhase = 0;			// offset of the radius pulse along the trajectory in [0, 1)
+	vtkIdType pulseLength = 0;		// number of trajectory points, the pulse advances by one point per Update
+	vtkSmartPointer<vtkRenderer> renderer;	// renderer whose camera sets the decimation tolerance
+	double tolerance = DefaultTolerance;	// decimation tolerance of the latest pick in world units
+	vtkSmartPointer<vtkTextActor> cacheStatus;	// status line of the trajectory cache
+
+	Vector3d lastPick;			// last picked world coordinate, re-integrated when the system changes
+	IntegratorSettings integrator;	// scheme, duration and sampling of the trajectory integration
+
+	/// <summary>
+	/// Pick queue of depth one that is shared with the worker task: a new pick replaces the pending one and
+	/// aborts the running one, so rapid clicking never queues stale work.
+	/// </summary>
+	struct PickQueue
+	{
+		std::mutex mutex;						// guards all members except latest
+		std::atomic<uint64_t> latest{ 0 };		// generation of the most recent pick
+		bool hasRequest = false;				// a pick waits for the worker
+		Vector3d request;						// world coordinate of the waiting pick
+		IntegratorSettings settings;			// integrator settings of the waiting pick
+		double tolerance = DefaultTolerance;	// decimation tolerance of the waiting pick or re-decimation
+		bool hasRetube = false;					// the latest trajectory waits to be re-decimated with tolerance
+		bool running = false;					// a worker task is active
+		vtkSmartPointer<vtkPolyData> result;	// back buffer with the finished trajectory of the latest pick
+		vtkSmartPointer<vtkPolyData> resultTube;	// back buffer with the tube around the finished trajectory
+		TrajectoryCache cache{ TrajectoryCache::Settings() };	// trajectories of earlier picks, used only by the worker
+		TrajectoryCache::Key currentKey;		// cache key of the latest finished pick, used only by the worker
+		TrajectoryCache::Entry current;			// trajectory and tube of the latest finished pick, used only by the worker
+	};
+	std::shared_ptr<PickQueue> picks = std::make_shared<PickQueue>();
+
+	/// <summary>
+	/// Piece of the streamed trajectory: one polyline in preallocated buffers with its own actor. Only the last
+	/// chunk grows; a full chunk is never modified again, so VTK does not upload it again.
+	/// </summary>
+	struct StreamChunk
+	{
+		vtkSmartPointer<vtkFloatArray> coords;			// point coordinates, preallocated for StreamChunkPoints points
+		vtkSmartPointer<vtkIdTypeArray> offsets;		// offsets of the single polyline cell
+		vtkSmartPointer<vtkIdTypeArray> connectivity;	// point ids of the polyline
+		vtkSmartPointer<vtkPolyData> data;				// geometry of the chunk
+		vtkSmartPointer<vtkActor> actor;				// actor that renders the polyline as a tube without a tube filter
+	};
+
+	// Streaming mode: the trajectory grows by a fixed number of integrator outputs per Update
+	bool streaming = false;						// streaming mode is active
+	bool streamDone = true;						// the streamed trajectory collided or escaped
+	Vector4d streamState;						// last state of the streamed trajectory
+	std::vector<StreamChunk> streamChunks;		// full chunks of the streamed trajectory, followed by the growing one
+	vtkSmartPointer<vtkProperty> streamProperty;	// appearance that the actors of all chunks share
 
 public:
 	/// <summary>
@@ -40,17 +120,11 @@ public:
 		// Step 1: Create trajectory BEFORE using it
 		trajectory = vtkSmartPointer<vtkPolyData>::New();
 
-		// Step 2: Create the tube filter and connect it
-		tubeFilter = vtkSmartPointer<vtkTubeFilter>::New();
-		tubeFilter->SetInputData(trajectory);
-		tubeFilter->SetNumberOfSides(24);   // Smooth tube
-		tubeFilter->SetVaryRadiusToVaryRadiusByAbsoluteScalar();
-		tubeFilter->SetRadius(MaxRadius);
-
-		// Step 3: Mapper (connect to tube output)
+		// Step 2: Mapper (the tube is built by the pick worker and swapped in by Update)
 		trajectoryMapper = vtkSmartPointer<vtkPolyDataMapper>::New();
-		trajectoryMapper->SetInputConnection(tubeFilter->GetOutputPort());
+		trajectoryMapper->SetInputData(trajectory);
 		trajectoryMapper->ScalarVisibilityOff();
+		trajectoryMapper->MapDataArrayToVertexAttribute("pulseParam", "PulseParam", vtkDataObject::FIELD_ASSOCIATION_POINTS, -1);
 
 		// Step 4: Actor
 		trajectoryActor = vtkSmartPointer<vtkActor>::New();
@@ -65,14 +139,50 @@ public:
 
 		prop->LightingOn();             // Optional: turn ON lighting for metallic shine
 
-		// Step 6: Radius array (create, but don't set size yet)
-		radiusArray = vtkSmartPointer<vtkFloatArray>::New();
-		radiusArray->SetName("TubeRadius");
+		// Step 6: Radius pulse, the vertex shader moves the vertices of the tube inwards along their normals
+		// to the radius of the pulse at the current phase, so the tube is built only once per trajectory
+		vtkShaderProperty* shader = trajectoryActor->GetShaderProperty();
+		shader->AddVertexShaderReplacement("//VTK::Normal::Dec", true,
+			"//VTK::Normal::Dec\n"
+			"in float pulseParam;\n"
+			"uniform float pulsePhase;\n"
+			"uniform float minRadius;\n"
+			"uniform float maxRadius;\n", false);
+		shader->AddVertexShaderReplacement("//VTK::PositionVC::Impl", true,
+			"float pulseRadius = minRadius + (maxRadius - minRadius) * fract(pulseParam - pulsePhase);\n"
+			"vec4 pulseVertexMC = vec4(vertexMC.xyz - normalMC * (maxRadius - pulseRadius), 1.0);\n"
+			"vertexVCVSOutput = MCVCMatrix * pulseVertexMC;\n"
+			"gl_Position = MCDCMatrix * pulseVertexMC;\n", false);
+		shader->GetVertexCustomUniforms()->SetUniformf("pulsePhase", 0.0f);
+		shader->GetVertexCustomUniforms()->SetUniformf("minRadius", (float)MinRadius);
+		shader->GetVertexCustomUniforms()->SetUniformf("maxRadius", (float)MaxRadius);
+
+		// Streaming geometry, rendered as tubes by the line shader so that it can grow without re-tubing
+		streamProperty = vtkSmartPointer<vtkProperty>::New();
+		streamProperty->SetColor(0.9, 0.3, 0.3);
+		streamProperty->SetLineWidth(4);
+		streamProperty->RenderLinesAsTubesOn();
+
+		// Status line of the trajectory cache, below the progress lines of the other components
+		cacheStatus = vtkSmartPointer<vtkTextActor>::New();
+		cacheStatus->GetTextProperty()->SetFontSize(14);
+		cacheStatus->GetTextProperty()->SetColor(0.8, 0.8, 0.8);
+		cacheStatus->SetDisplayPosition(10, 20);
+
+		integrator.type = IntegratorType::RK4;
+		integrator.stepSize = IntegrationStepSize;
+		integrator.outputInterval = IntegrationStepSize;
+		integrator.duration = (NumIntegrationSteps - 1) * IntegrationStepSize;
 
 		Pick(Vector3d(1.019, -0.008, 0.0));
 
 	}
 
+	/// <summary>
+	/// Destructor. Aborts the running pick.
+	/// </summary>
+	~Tracer() { picks->latest++; }
+
 	/// <summary>
 	/// Updates the properties of the tail geometry.
 	/// </summary>
@@ -80,89 +190,143 @@ public:
 	/// <param name="t">Total time passed since start of the application in milliseconds.</param>
 	void Update(double dt, double t)
 	{
-		if (!radiusArray) return;
+		if (streaming)
+		{
+			Stream();
+			return;
+		}
 
-		// Rotate the radius array forward by one (pulse moves ahead)
-		float last = radiusArray->GetValue(radiusArray->GetNumberOfTuples() - 1);
-		for (vtkIdType i = radiusArray->GetNumberOfTuples() - 1; i > 0; --i) {
-			radiusArray->SetValue(i, radiusArray->GetValue(i - 1));
+		// swap in the trajectory of the latest pick once the worker finished it
+		vtkSmartPointer<vtkPolyData> finished, tube;
+		{
+			std::lock_guard<std::mutex> lock(picks->mutex);
+			finished = picks->result;
+			tube = picks->resultTube;
+			picks->result = nullptr;
+			picks->resultTube = nullptr;
+		}
+		if (finished)
+		{
+			trajectory = finished;
+			pulseLength = trajectory->GetNumberOfPoints();
+		}
+		if (tube)
+		{
+			trajectoryMapper->SetInputData(tube);
+			UpdateCacheStatus();
 		}
-		radiusArray->SetValue(0, last);
 
-		// Apply updated radii
-		trajectory->GetPointData()->SetScalars(radiusArray);
-		trajectory->Modified();
-		tubeFilter->Update();
+		if (pulseLength == 0) return;
+
+		// Move the pulse ahead by one point, only the phase uniform changes
+		pulsePhase = std::fmod(pulsePhase + 1.0 / pulseLength, 1.0);
+		trajectoryActor->GetShaderProperty()->GetVertexCustomUniforms()->SetUniformf("pulsePhase", (float)pulsePhase);
 	}
 
 	/// <summary>
-	/// Calculates a trajectory from the picked point.
+	/// Computes the initial state of a trajectory that starts at a given position. The speed follows from the
+	/// Jacobi level, the direction is tangential around the Earth, rotated by the launch angle.
 	/// </summary>
-	/// <param name="pnt">3D world coordinate that was picked.</param>
-	void Pick(const Vector3d& pnt)
+	/// <param name="pos">Start position.</param>
+	/// <param name="angle">Launch angle relative to the tangential direction in radians.</param>
+	/// <returns>Initial state containing position and velocity.</returns>
+	static Vector4d InitialState(const Vector2d& pos, double angle = LaunchAngle)
 	{
-		vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
-		vtkSmartPointer<vtkCellArray> lines = vtkSmartPointer<vtkCellArray>::New();
-		Vector2d pos(pnt.x(), pnt.y());
-		//double jacobi_C = 3.1396645; // This is your yellow isoline
-		double jacobi_C = 3.139855;
 		double U = CRTBP::PseudoPotential(pos);
-		double vmag = sqrt(std::max(2 * U - jacobi_C, 0.0));
+		double vmag = sqrt(std::max(2 * U - JacobiLevel, 0.0));
 		Vector2d earth = CRTBP::Earth();
 		Vector2d rel = pos - earth;
 		Vector2d vel(-rel.y(), rel.x());
 		vel.normalize();
-		double angle = -0.008; // try between 0.005 and 0.015 radians
 		double cs = cos(angle), sn = sin(angle);
 		Vector2d vel2(vel.x() * cs - vel.y() * sn, vel.x() * sn + vel.y() * cs);
 		vel2.normalize();
 		vel2 *= vmag;
+		return Vector4d(pos.x(), pos.y(), vel2.x(), vel2.y());
+	}
 
+	/// <summary>
+	/// Gets the last picked world coordinate.
+	/// </summary>
+	const Vector3d& GetLastPick() const { return lastPick; }
 
+	/// <summary>
+	/// Gets the cache of the picked trajectories. Its counters are shown in the status line of the tracer.
+	/// </summary>
+	const TrajectoryCache& GetCache() const { return picks->cache; }
 
-		Vector4d state(pos.x(), pos.y(), vel2.x(), vel2.y());
-
-		double t = 0.0;
-		points->InsertNextPoint(state[0], state[1], 0.0);
-		vtkIdType prevId = 0;
+	/// <summary>
+	/// Gets the Jacobi constant of the picked trajectories.
+	/// </summary>
+	static double GetJacobiLevel() { return JacobiLevel; }
 
-		for (int i = 1; i < NumIntegrationSteps; ++i)
+	/// <summary>
+	/// Calculates a trajectory from the picked point. The trajectory is integrated on a worker thread and
+	/// swapped in by the first Update after it is finished; a newer pick cancels it.
+	/// </summary>
+	/// <param name="pnt">3D world coordinate that was picked.</param>
+	void Pick(const Vector3d& pnt)
+	{
+		lastPick = pnt;
+		if (streaming)
 		{
-			Vector4d k1 = CRTBP::Direction(state);
-			Vector4d k2 = CRTBP::Direction(state + (IntegrationStepSize / 2.0) * k1);
-			Vector4d k3 = CRTBP::Direction(state + (IntegrationStepSize / 2.0) * k2);
-			Vector4d k4 = CRTBP::Direction(state + IntegrationStepSize * k3);
-
-			Vector4d nextState = state + (IntegrationStepSize / 6.0) * (k1 + 2.0 * k2 + 2.0 * k3 + k4);
-
-			state = nextState;
-			t += IntegrationStepSize;
-
-			vtkIdType id = points->InsertNextPoint(state[0], state[1], 0.0);
-			lines->InsertNextCell(2);
-			lines->InsertCellPoint(prevId);
-			lines->InsertCellPoint(id);
-			prevId = id;
+			StartStream();
+			return;
 		}
+		tolerance = ScreenTolerance();
+		std::lock_guard<std::mutex> lock(picks->mutex);
+		picks->latest++;
+		picks->request = pnt;
+		picks->settings = integrator;
+		picks->tolerance = tolerance;
+		picks->hasRequest = true;
+		if (picks->running) return;
+		picks->running = true;
+		std::shared_ptr<PickQueue> queue = picks;
+		ThreadPool::Shared().Submit([queue] { ProcessPicks(*queue); });
+	}
 
-		// Update vtkPolyData
-		trajectory->SetPoints(points);
-		trajectory->SetLines(lines);
-		radiusArray->SetNumberOfValues(points->GetNumberOfPoints());
-		float maxRadius = MaxRadius;  // e.g. 0.01
-		float minRadius = 0.002f; // or 0.002f for even thinner start
-		for (vtkIdType i = 0; i < points->GetNumberOfPoints(); ++i)
-		{
+	/// <summary>
+	/// Selects the integration scheme of this tracer and re-integrates the last picked trajectory.
+	/// The adaptive scheme samples its dense output with the same spacing as the fixed step scheme.
+	/// </summary>
+	/// <param name="type">Integration scheme.</param>
+	void SetIntegrator(IntegratorType type)
+	{
+		integrator.type = type;
+		Pick(lastPick);
+	}
 
-			float scalar = minRadius + (maxRadius - minRadius) * (static_cast<float>(i) / (points->GetNumberOfPoints() - 1));
-			radiusArray->SetValue(i, scalar);
+	/// <summary>
+	/// Gets the integration scheme of this tracer.
+	/// </summary>
+	/// <returns>Integration scheme.</returns>
+	IntegratorType GetIntegrator() const { return integrator.type; }
 
-		}
-		// Attach the array to points:
-		trajectory->GetPointData()->SetScalars(radiusArray);
-		trajectory->Modified();
-		tubeFilter->Update();
+	/// <summary>
+	/// Gets the scheme, duration and sampling of the trajectory integration.
+	/// </summary>
+	/// <returns>Integrator settings of this tracer.</returns>
+	const IntegratorSettings& GetIntegratorSettings() const { return integrator; }
 
+	/// <summary>
+	/// Switches between the fixed length trajectory and streaming mode, in which the trajectory of the last pick
+	/// keeps growing by a fixed number of integrator outputs per Update until it collides or escapes.
+	/// </summary>
+	void ToggleStreaming()
+	{
+		streaming = !streaming;
+		trajectoryActor->SetVisibility(!streaming);
+		if (!streaming) ClearStream();
+		Pick(lastPick);
+	}
+
+	/// <summary>
+	/// Re-integrates the last picked trajectory in the system selected by CRTBP::SetSystem.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		Pick(lastPick);
 	}
 
 	/// <summary>
@@ -172,10 +336,477 @@ public:
 	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
 	{
 		renderer->AddActor(trajectoryActor);
+		renderer->AddActor2D(cacheStatus);
+		this->renderer = renderer;
+
+		// --- Camera callback, re-decimates the tube once the camera moved so far that the decimation is visible or wasteful ---
+		struct CameraCallback : public vtkCommand
+		{
+			static CameraCallback* New() { return new CameraCallback; }
+
+			void Execute(vtkObject*, unsigned long, void*) override
+			{
+				tracer->OnCameraModified();
+			}
+
+			Tracer* tracer = nullptr;
+		};
+
+		vtkSmartPointer<CameraCallback> cameraCallback = vtkSmartPointer<CameraCallback>::New();
+		cameraCallback->tracer = this;
+		renderer->GetActiveCamera()->AddObserver(vtkCommand::ModifiedEvent, cameraCallback);
 	}
 
 private:
 
 	Tracer(const Tracer&) = delete;				// Delete the copy-constructor.
 	void operator=(const Tracer&) = delete;		// Delete the assignment operator.
+
+	/// <summary>
+	/// Computes the decimation tolerance in world units that corresponds to DecimationPixels at the distance
+	/// of the last pick from the camera.
+	/// </summary>
+	double ScreenTolerance() const
+	{
+		if (!renderer || renderer->GetSize()[1] <= 0) return DefaultTolerance;
+		vtkCamera* camera = renderer->GetActiveCamera();
+		double height;
+		if (camera->GetParallelProjection())
+			height = 2 * camera->GetParallelScale();
+		else
+		{
+			double* eye = camera->GetPosition();
+			double distance = (Vector3d(eye[0], eye[1], eye[2]) - lastPick).norm();
+			height = 2 * distance * std::tan(vtkMath::RadiansFromDegrees(camera->GetViewAngle()) / 2);
+		}
+		return DecimationPixels * height / renderer->GetSize()[1];
+	}
+
+	/// <summary>
+	/// Shows the size and the hit and miss counters of the trajectory cache in the status line.
+	/// </summary>
+	void UpdateCacheStatus()
+	{
+		const TrajectoryCache& cache = picks->cache;
+		std::string text = "Trajectory cache: " + std::to_string(cache.Size()) + " trajectories, "
+			+ std::to_string(cache.MemoryBytes() >> 10) + " KiB, " + std::to_string(cache.Hits()) + " hits, "
+			+ std::to_string(cache.Misses()) + " misses";
+		cacheStatus->SetInput(text.c_str());
+	}
+
+	/// <summary>
+	/// Requests a new tube for the latest trajectory once the screen tolerance left [0.5, 4] times the tolerance
+	/// of the current tube. The worker only decimates and tubes the trajectory again, it does not re-integrate it.
+	/// </summary>
+	void OnCameraModified()
+	{
+		if (streaming) return;
+		double required = ScreenTolerance();
+		if (required >= 0.5 * tolerance && required <= 4 * tolerance) return;
+		tolerance = required;
+		std::lock_guard<std::mutex> lock(picks->mutex);
+		picks->tolerance = required;
+		picks->hasRetube = true;
+		if (picks->running) return;
+		picks->running = true;
+		std::shared_ptr<PickQueue> queue = picks;
+		ThreadPool::Shared().Submit([queue] { ProcessPicks(*queue); });
+	}
+
+	/// <summary>
+	/// Restarts the streamed trajectory at the last pick.
+	/// </summary>
+	void StartStream()
+	{
+		ClearStream();
+		streamState = InitialState(Vector2d(lastPick.x(), lastPick.y()));
+		streamDone = false;
+		AppendStreamPoint(streamState[0], streamState[1]);
+		CommitStreamChunk(streamChunks.back());
+	}
+
+	/// <summary>
+	/// Removes the chunks of the streamed trajectory from the renderer.
+	/// </summary>
+	void ClearStream()
+	{
+		if (renderer)
+			for (const StreamChunk& chunk : streamChunks)
+				renderer->RemoveActor(chunk.actor);
+		streamChunks.clear();
+	}
+
+	/// <summary>
+	/// Appends the next outputs of the integrator of this tracer to the streamed trajectory, until a collision
+	/// with the Sun or the Earth (entering its radius, as in the fixed length trajectory) or an escape. Only the
+	/// chunks that received points are marked as modified, so the upload per call is bounded by the chunk size
+	/// and does not grow with the length of the trajectory.
+	/// </summary>
+	void Stream()
+	{
+		if (streamDone || streamChunks.empty()) return;
+		size_t growing = streamChunks.size() - 1;
+
+		IntegratorSettings settings = integrator;
+		double interval = integrator.type == IntegratorType::RK4 ? integrator.stepSize : integrator.outputInterval;
+		settings.duration = StreamStepsPerUpdate * interval;
+		std::vector<EventHit> hits;
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			std::vector<Event> events = Event::Terminations<Model>(TerminationSettings());
+			Integrator::Integrate<Model>(streamState, settings, [&](double t, const Vector4d& s)
+			{
+				if (t == 0) return;		// the start state is the last point of the previous Update
+				streamState = s;
+				AppendStreamPoint(s[0], s[1]);
+			}, events, &hits);
+		});
+		streamDone = !hits.empty();
+
+		for (size_t i = growing; i < streamChunks.size(); ++i)
+			CommitStreamChunk(streamChunks[i]);
+	}
+
+	/// <summary>
+	/// Appends a point to the growing chunk of the streamed trajectory. Once the chunk is full, a new chunk
+	/// starts at its last point, so that the polylines of consecutive chunks join without a gap.
+	/// </summary>
+	void AppendStreamPoint(double x, double y)
+	{
+		if (streamChunks.empty() || streamChunks.back().coords->GetNumberOfTuples() == StreamChunkPoints)
+		{
+			StreamChunk chunk;
+			chunk.coords = vtkSmartPointer<vtkFloatArray>::New();
+			chunk.coords->SetNumberOfComponents(3);
+			chunk.coords->Allocate(3 * StreamChunkPoints);
+			chunk.offsets = vtkSmartPointer<vtkIdTypeArray>::New();
+			chunk.offsets->SetNumberOfValues(2);
+			chunk.offsets->SetValue(0, 0);
+			chunk.offsets->SetValue(1, 0);
+			chunk.connectivity = vtkSmartPointer<vtkIdTypeArray>::New();
+			chunk.connectivity->Allocate(StreamChunkPoints);
+
+			auto points = vtkSmartPointer<vtkPoints>::New();
+			points->SetData(chunk.coords);
+			auto lines = vtkSmartPointer<vtkCellArray>::New();
+			lines->SetData(chunk.offsets, chunk.connectivity);
+			chunk.data = vtkSmartPointer<vtkPolyData>::New();
+			chunk.data->SetPoints(points);
+			chunk.data->SetLines(lines);
+
+			auto mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+			mapper->SetInputData(chunk.data);
+			mapper->ScalarVisibilityOff();
+			chunk.actor = vtkSmartPointer<vtkActor>::New();
+			chunk.actor->SetMapper(mapper);
+			chunk.actor->SetProperty(streamProperty);
+			if (renderer) renderer->AddActor(chunk.actor);
+
+			if (!streamChunks.empty())
+			{
+				float* last = streamChunks.back().coords->GetPointer(3 * (StreamChunkPoints - 1));
+				chunk.coords->InsertNextTuple3(last[0], last[1], last[2]);
+				chunk.connectivity->InsertNextValue(0);
+			}
+			streamChunks.push_back(chunk);
+		}
+
+		StreamChunk& chunk = streamChunks.back();
+		vtkIdType id = chunk.coords->GetNumberOfTuples();
+		chunk.coords->InsertNextTuple3(x, y, 0.0);
+		chunk.connectivity->InsertNextValue(id);
+	}
+
+	/// <summary>
+	/// Closes the polyline of a chunk after its last point and marks the chunk as modified.
+	/// </summary>
+	static void CommitStreamChunk(StreamChunk& chunk)
+	{
+		chunk.offsets->SetValue(1, chunk.connectivity->GetNumberOfValues());
+		chunk.coords->Modified();
+		chunk.offsets->Modified();
+		chunk.connectivity->Modified();
+		chunk.data->Modified();
+	}
+
+	/// <summary>
+	/// Worker loop that integrates the waiting pick, or re-decimates the latest trajectory, until no work is left.
+	/// Only the trajectory of the most recent pick is handed to the back buffer.
+	/// </summary>
+	static void ProcessPicks(PickQueue& queue)
+	{
+		for (;;)
+		{
+			Vector3d pnt;
+			IntegratorSettings settings;
+			double tolerance;
+			uint64_t generation;
+			bool retube;
+			{
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (!queue.hasRequest && !queue.hasRetube)
+				{
+					queue.running = false;
+					return;
+				}
+				retube = !queue.hasRequest;		// a waiting pick is tubed with the latest tolerance anyway
+				pnt = queue.request;
+				settings = queue.settings;
+				tolerance = queue.tolerance;
+				generation = queue.latest;
+				queue.hasRequest = false;
+				queue.hasRetube = false;
+			}
+
+			// re-decimate the trajectory of the latest pick for the new tolerance, it is not integrated again
+			if (retube)
+			{
+				if (!queue.current.trajectory) continue;
+				queue.current.tube = Tube(queue.current.trajectory, tolerance);
+				queue.current.tolerance = tolerance;
+				queue.cache.Insert(queue.currentKey, queue.current);
+
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (queue.latest == generation)
+					queue.resultTube = queue.current.tube;
+				continue;
+			}
+
+			// reuse the trajectory of an earlier pick at the same spot, a cancelled one is incomplete and not stored
+			TrajectoryCache::Key key = queue.cache.MakeKey(InitialState(Vector2d(pnt.x(), pnt.y())), settings);
+			TrajectoryCache::Entry entry;
+			if (!queue.cache.Find(key, entry))
+				entry.trajectory = Integrate(pnt, settings, [&] { return queue.latest != generation; });
+			if (queue.latest != generation) continue;
+
+			// the cached tube is reused while its tolerance is close to the current one
+			if (!entry.tube || entry.tolerance < 0.5 * tolerance || entry.tolerance > 2 * tolerance)
+			{
+				entry.tube = Tube(entry.trajectory, tolerance);
+				entry.tolerance = tolerance;
+				queue.cache.Insert(key, entry);
+			}
+			queue.currentKey = key;
+			queue.current = entry;
+
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.latest == generation)
+			{
+				queue.result = entry.trajectory;
+				queue.resultTube = entry.tube;
+			}
+		}
+	}
+
+	/// <summary>
+	/// Integrates the trajectory of a picked point into a new polyline. The integrator writes positions, the
+	/// polyline connectivity and the per-point attributes (pulse parameter, speed and drift of the Jacobi constant)
+	/// in a single pass into contiguous buffers that are handed to VTK without copying.
+	/// </summary>
+	/// <param name="pnt">3D world coordinate that was picked.</param>
+	/// <param name="settings">Integrator settings.</param>
+	/// <param name="cancelled">Returns true once the trajectory is no longer needed, which stops the integration.</param>
+	/// <returns>Trajectory geometry.</returns>
+	template<typename Cancelled>
+	static vtkSmartPointer<vtkPolyData> Integrate(const Vector3d& pnt, const IntegratorSettings& settings, Cancelled cancelled)
+	{
+		Vector4d state = InitialState(Vector2d(pnt.x(), pnt.y()));
+
+		// the number of emitted states is known up to the start state and a terminal event
+		double interval = settings.type == IntegratorType::RK4 ? settings.stepSize : settings.outputInterval;
+		size_t capacity = (size_t)(std::abs(settings.duration) / interval) + 3;
+		Buffer<float> coords = Allocate<float>(3 * capacity);
+		Buffer<float> pulse = Allocate<float>(capacity);
+		Buffer<float> speed = Allocate<float>(capacity);
+		Buffer<float> drift = Allocate<float>(capacity);
+		Buffer<vtkIdType> connectivity = Allocate<vtkIdType>(capacity);
+		size_t count = 0;
+
+		CRTBP::Dispatch([&](auto model)
+		{
+			using Model = decltype(model);
+			std::vector<Event> events = Event::Terminations<Model>(TerminationSettings());
+			double jacobi0 = Model::JacobiConstant(Vector2d(state[0], state[1]), state.template tail<2>().squaredNorm());
+			Integrator::Integrate<Model>(state, settings, [&](double t, const Vector4d& s)
+			{
+				if (count == capacity)
+				{
+					capacity *= 2;
+					Grow(coords, 3 * capacity);
+					Grow(pulse, capacity);
+					Grow(speed, capacity);
+					Grow(drift, capacity);
+					Grow(connectivity, capacity);
+				}
+				Vector2d pos(s[0], s[1]), vel(s[2], s[3]);
+				float* p = coords.get() + 3 * count;
+				p[0] = (float)s[0]; p[1] = (float)s[1]; p[2] = 0.0f;
+				pulse.get()[count] = (float)(t / settings.duration);
+				speed.get()[count] = (float)vel.norm();
+				drift.get()[count] = (float)(Model::JacobiConstant(pos, vel.squaredNorm()) - jacobi0);
+				connectivity.get()[count] = (vtkIdType)count;
+				++count;
+			}, events, nullptr, cancelled);
+		});
+
+		vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+		points->SetData(Wrap<vtkFloatArray>(coords, count, 3, nullptr));
+
+		Buffer<vtkIdType> offsets = Allocate<vtkIdType>(2);
+		offsets.get()[0] = 0;
+		offsets.get()[1] = (vtkIdType)count;
+		vtkSmartPointer<vtkCellArray> lines = vtkSmartPointer<vtkCellArray>::New();
+		lines->SetData(Wrap<vtkIdTypeArray>(offsets, 2, 1, nullptr), Wrap<vtkIdTypeArray>(connectivity, count, 1, nullptr));
+
+		vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+		polyData->SetPoints(points);
+		polyData->SetLines(lines);
+		polyData->GetPointData()->AddArray(Wrap<vtkFloatArray>(pulse, count, 1, "PulseParam"));
+		polyData->GetPointData()->AddArray(Wrap<vtkFloatArray>(speed, count, 1, "Speed"));
+		polyData->GetPointData()->AddArray(Wrap<vtkFloatArray>(drift, count, 1, "JacobiDrift"));
+		return polyData;
+	}
+
+	/// <summary>
+	/// Builds the tube around the decimated trajectory with the maximum radius. The pulse narrows it in the
+	/// vertex shader.
+	/// </summary>
+	/// <param name="trajectory">Trajectory from Integrate.</param>
+	/// <param name="tolerance">Largest deviation of the tube centerline from the trajectory in world units.</param>
+	static vtkSmartPointer<vtkPolyData> Tube(vtkPolyData* trajectory, double tolerance)
+	{
+		vtkIdType count = trajectory->GetNumberOfPoints();
+		const float* coords = vtkFloatArray::SafeDownCast(trajectory->GetPoints()->GetData())->GetPointer(0);
+		const float* speed = vtkFloatArray::SafeDownCast(trajectory->GetPointData()->GetArray("Speed"))->GetPointer(0);
+		const float* pulse = vtkFloatArray::SafeDownCast(trajectory->GetPointData()->GetArray("PulseParam"))->GetPointer(0);
+		std::vector<vtkIdType> kept = Decimate(coords, speed, count, tolerance);
+
+		// centerline with the kept points, only the pulse parameter is needed by the tube
+		size_t n = kept.size();
+		Buffer<float> keptCoords = Allocate<float>(3 * n);
+		Buffer<float> keptPulse = Allocate<float>(n);
+		Buffer<vtkIdType> connectivity = Allocate<vtkIdType>(n);
+		for (size_t k = 0; k < n; ++k)
+		{
+			std::copy(coords + 3 * kept[k], coords + 3 * kept[k] + 3, keptCoords.get() + 3 * k);
+			keptPulse.get()[k] = pulse[kept[k]];
+			connectivity.get()[k] = (vtkIdType)k;
+		}
+		vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+		points->SetData(Wrap<vtkFloatArray>(keptCoords, n, 3, nullptr));
+		Buffer<vtkIdType> offsets = Allocate<vtkIdType>(2);
+		offsets.get()[0] = 0;
+		offsets.get()[1] = (vtkIdType)n;
+		vtkSmartPointer<vtkCellArray> lines = vtkSmartPointer<vtkCellArray>::New();
+		lines->SetData(Wrap<vtkIdTypeArray>(offsets, 2, 1, nullptr), Wrap<vtkIdTypeArray>(connectivity, n, 1, nullptr));
+		vtkSmartPointer<vtkPolyData> centerline = vtkSmartPointer<vtkPolyData>::New();
+		centerline->SetPoints(points);
+		centerline->SetLines(lines);
+		centerline->GetPointData()->AddArray(Wrap<vtkFloatArray>(keptPulse, n, 1, "PulseParam"));
+
+		vtkSmartPointer<vtkTubeFilter> tubeFilter = vtkSmartPointer<vtkTubeFilter>::New();
+		tubeFilter->SetInputData(centerline);
+		tubeFilter->SetNumberOfSides(24);   // Smooth tube
+		tubeFilter->SetVaryRadiusToVaryRadiusOff();
+		tubeFilter->SetRadius(MaxRadius);
+		tubeFilter->Update();
+		return tubeFilter->GetOutput();
+	}
+
+	/// <summary>
+	/// Selects the points of a polyline that keep it within a tolerance (Douglas-Peucker). A point is also kept
+	/// where the speed deviates by more than DecimationSpeedError from its linear interpolation, so close flybys,
+	/// where both the curvature and the speed change quickly, stay densely sampled while quiet arcs are thinned.
+	/// </summary>
+	/// <param name="coords">Positions, three floats per point.</param>
+	/// <param name="speed">Speed per point.</param>
+	/// <param name="count">Number of points.</param>
+	/// <param name="tolerance">Largest distance of a dropped point from the decimated polyline.</param>
+	/// <returns>Indices of the kept points in increasing order.</returns>
+	static std::vector<vtkIdType> Decimate(const float* coords, const float* speed, vtkIdType count, double tolerance)
+	{
+		std::vector<char> keep(count, 0);
+		if (count > 0) keep[0] = keep[count - 1] = 1;
+		std::vector<std::pair<vtkIdType, vtkIdType>> spans;
+		if (count > 2) spans.emplace_back(0, count - 1);
+		while (!spans.empty())
+		{
+			auto [a, b] = spans.back();
+			spans.pop_back();
+
+			// find the point with the largest error relative to its bound
+			Vector2d pa(coords[3 * a], coords[3 * a + 1]), pb(coords[3 * b], coords[3 * b + 1]);
+			Vector2d d = pb - pa;
+			double length2 = d.squaredNorm();
+			double worst = 1;
+			vtkIdType split = -1;
+			for (vtkIdType i = a + 1; i < b; ++i)
+			{
+				Vector2d p(coords[3 * i], coords[3 * i + 1]);
+				double s = length2 > 0 ? std::clamp((p - pa).dot(d) / length2, 0.0, 1.0) : 0.0;
+				double error = (p - pa - s * d).norm() / tolerance;
+				double u = (double)(i - a) / (b - a);
+				double interpolated = speed[a] + u * (speed[b] - speed[a]);
+				error = std::max(error, std::abs(speed[i] - interpolated) / (DecimationSpeedError * std::max(std::abs(speed[i]), 1e-6f)));
+				if (error > worst)
+				{
+					worst = error;
+					split = i;
+				}
+			}
+			if (split < 0) continue;
+			keep[split] = 1;
+			spans.emplace_back(a, split);
+			spans.emplace_back(split, b);
+		}
+
+		std::vector<vtkIdType> kept;
+		for (vtkIdType i = 0; i < count; ++i)
+			if (keep[i]) kept.push_back(i);
+		return kept;
+	}
+
+	/// <summary>
+	/// Buffer allocated with malloc, which is freed unless it is handed to VTK.
+	/// </summary>
+	template<typename T>
+	using Buffer = std::unique_ptr<T, decltype(&std::free)>;
+
+	/// <summary>
+	/// Allocates a buffer with malloc, so that VTK can take ownership of it.
+	/// </summary>
+	template<typename T>
+	static Buffer<T> Allocate(size_t count)
+	{
+		Buffer<T> buffer(nullptr, &std::free);
+		Grow(buffer, count);
+		return buffer;
+	}
+
+	/// <summary>
+	/// Grows a buffer with realloc. If that fails, the buffer keeps its old memory.
+	/// </summary>
+	template<typename T>
+	static void Grow(Buffer<T>& buffer, size_t count)
+	{
+		T* result = static_cast<T*>(std::realloc(buffer.get(), std::max<size_t>(count, 1) * sizeof(T)));
+		if (!result) throw std::bad_alloc();
+		buffer.release();
+		buffer.reset(result);
+	}
+
+	/// <summary>
+	/// Wraps a malloc buffer in a VTK array that takes ownership of it. The buffer is released only once the
+	/// array exists.
+	/// </summary>
+	template<typename Array, typename T>
+	static vtkSmartPointer<Array> Wrap(Buffer<T>& buffer, size_t numTuples, int numComponents, const char* name)
+	{
+		vtkSmartPointer<Array> array = vtkSmartPointer<Array>::New();
+		array->SetNumberOfComponents(numComponents);
+		if (name) array->SetName(name);
+		array->SetArray(buffer.release(), (vtkIdType)(numTuples * numComponents), 0, Array::VTK_DATA_ARRAY_FREE);
+		return array;
+	}
 };
\ No newline at end of file
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "math.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkPolyData.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkFloatArray.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkCellData.h>
+#include <vtkActor.h>
+#include <vtkProperty.h>
+#include <vtkShaderProperty.h>
+#include <vtkRenderer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// Class that renders many trajectories at once. All trajectories are packed into one polydata with one
+/// polyline cell per trajectory and drawn by a single mapper and actor, with the lines rendered as tubes.
+/// The color and visibility of each trajectory are stored in an RGBA cell attribute; hidden trajectories have
+/// zero alpha and are discarded in the fragment shader. Adding a trajectory appends to the buffers, removing
+/// one only hides it; the buffers are compacted once the removed points outnumber the remaining ones.
+/// </summary>
+class TracerSet
+{
+public:
+	using Id = uint64_t;
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	TracerSet()
+	{
+		mColors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+		mColors->SetName("TrajectoryColor");
+		mColors->SetNumberOfComponents(4);
+
+		mPolyData = vtkSmartPointer<vtkPolyData>::New();
+		Reset();
+
+		auto mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+		mapper->SetInputData(mPolyData);
+		mapper->SetScalarModeToUseCellData();
+		mapper->SetColorModeToDirectScalars();
+
+		mActor = vtkSmartPointer<vtkActor>::New();
+		mActor->SetMapper(mapper);
+		mActor->GetProperty()->SetLineWidth(2);
+		mActor->GetProperty()->RenderLinesAsTubesOn();
+		mActor->ForceOpaqueOn();	// alpha only encodes the visibility
+		mActor->GetShaderProperty()->AddFragmentShaderReplacement("//VTK::Color::Impl", true,
+			"//VTK::Color::Impl\n"
+			"if (opacity <= 0.0) discard;\n", false);
+	}
+
+	/// <summary>
+	/// Appends a trajectory.
+	/// </summary>
+	/// <param name="count">Number of points of the trajectory.</param>
+	/// <param name="position">Function that returns the position of point j as Vector2d.</param>
+	/// <param name="color">RGB color in [0, 1].</param>
+	/// <returns>Handle of the trajectory.</returns>
+	template<typename Position>
+	Id Add(size_t count, Position position, const Vector3d& color)
+	{
+		vtkIdType first = mPoints->GetNumberOfPoints();
+		vtkFloatArray* coords = vtkFloatArray::SafeDownCast(mPoints->GetData());
+		float* p = coords->WritePointer(3 * first, 3 * (vtkIdType)count);
+		mIds.resize(count);
+		for (size_t j = 0; j < count; ++j)
+		{
+			Vector2d pos = position(j);
+			p[3 * j + 0] = (float)pos.x();
+			p[3 * j + 1] = (float)pos.y();
+			p[3 * j + 2] = 0.0f;
+			mIds[j] = first + (vtkIdType)j;
+		}
+		mLines->InsertNextCell((vtkIdType)count, mIds.data());
+
+		Slot slot;
+		slot.id = mNextId++;
+		slot.firstPoint = first;
+		slot.numPoints = (vtkIdType)count;
+		for (int c = 0; c < 3; ++c)
+			slot.color[c] = (unsigned char)(255 * std::min(std::max(color[c], 0.0), 1.0));
+		slot.color[3] = 255;
+		mColors->InsertNextTypedTuple(slot.color);
+		mCells[slot.id] = (vtkIdType)mSlots.size();
+		mSlots.push_back(slot);
+		mLivePoints += slot.numPoints;
+
+		mPoints->Modified();
+		mLines->Modified();
+		mColors->Modified();
+		mPolyData->Modified();
+		return slot.id;
+	}
+
+	/// <summary>
+	/// Removes a trajectory. Unknown handles are ignored.
+	/// </summary>
+	void Remove(Id id)
+	{
+		auto it = mCells.find(id);
+		if (it == mCells.end()) return;
+		Slot& slot = mSlots[it->second];
+		slot.removed = true;
+		SetAlpha(it->second, 0);
+		mCells.erase(it);
+		mLivePoints -= slot.numPoints;
+		mRemovedPoints += slot.numPoints;
+		if (mRemovedPoints > mLivePoints)
+			Compact();
+	}
+
+	/// <summary>
+	/// Sets the color of a trajectory.
+	/// </summary>
+	/// <param name="id">Handle of the trajectory.</param>
+	/// <param name="color">RGB color in [0, 1].</param>
+	void SetColor(Id id, const Vector3d& color)
+	{
+		auto it = mCells.find(id);
+		if (it == mCells.end()) return;
+		Slot& slot = mSlots[it->second];
+		for (int c = 0; c < 3; ++c)
+			slot.color[c] = (unsigned char)(255 * std::min(std::max(color[c], 0.0), 1.0));
+		SetAlpha(it->second, slot.color[3]);
+	}
+
+	/// <summary>
+	/// Shows or hides a trajectory.
+	/// </summary>
+	void SetVisible(Id id, bool visible)
+	{
+		auto it = mCells.find(id);
+		if (it == mCells.end()) return;
+		mSlots[it->second].color[3] = visible ? 255 : 0;
+		SetAlpha(it->second, mSlots[it->second].color[3]);
+	}
+
+	/// <summary>
+	/// Removes all trajectories.
+	/// </summary>
+	void Clear()
+	{
+		Reset();
+		mPolyData->Modified();
+	}
+
+	/// <summary>
+	/// Gets the number of trajectories.
+	/// </summary>
+	size_t Size() const { return mCells.size(); }
+
+	/// <summary>
+	/// Removes all trajectories, since they belong to the previous system.
+	/// </summary>
+	void OnSystemChanged()
+	{
+		Clear();
+	}
+
+	/// <summary>
+	/// Adds the actor to the renderer.
+	/// </summary>
+	/// <param name="renderer">Renderer to add the actor to.</param>
+	void InitRenderer(vtkSmartPointer<vtkRenderer> renderer)
+	{
+		renderer->AddActor(mActor);
+	}
+
+private:
+	TracerSet(const TracerSet&) = delete;			// Delete the copy-constructor.
+	void operator=(const TracerSet&) = delete;		// Delete the assignment operator.
+
+	/// <summary>
+	/// Trajectory stored in the buffers, one per polyline cell.
+	/// </summary>
+	struct Slot
+	{
+		Id id = 0;						// handle of the trajectory
+		vtkIdType firstPoint = 0;		// first point of the trajectory, its points are consecutive
+		vtkIdType numPoints = 0;		// number of points of the trajectory
+		unsigned char color[4] = {};	// RGB color and visibility
+		bool removed = false;			// the cell waits for the next compaction
+	};
+
+	/// <summary>
+	/// Writes the alpha value of a cell, keeping the color of the slot.
+	/// </summary>
+	void SetAlpha(vtkIdType cell, unsigned char alpha)
+	{
+		unsigned char rgba[4] = { mSlots[cell].color[0], mSlots[cell].color[1], mSlots[cell].color[2], alpha };
+		mColors->SetTypedTuple(cell, rgba);
+		mColors->Modified();
+		mPolyData->Modified();
+	}
+
+	/// <summary>
+	/// Replaces the buffers by empty ones.
+	/// </summary>
+	void Reset()
+	{
+		mPoints = vtkSmartPointer<vtkPoints>::New();
+		mPoints->SetDataTypeToFloat();
+		mLines = vtkSmartPointer<vtkCellArray>::New();
+		mColors->Reset();
+		mPolyData->SetPoints(mPoints);
+		mPolyData->SetLines(mLines);
+		mPolyData->GetCellData()->SetScalars(mColors);
+		mSlots.clear();
+		mCells.clear();
+		mLivePoints = mRemovedPoints = 0;
+	}
+
+	/// <summary>
+	/// Moves the remaining trajectories to the front of new buffers, dropping the removed ones.
+	/// The handles stay valid.
+	/// </summary>
+	void Compact()
+	{
+		vtkSmartPointer<vtkPoints> oldPoints = mPoints;
+		std::vector<Slot> oldSlots;
+		oldSlots.swap(mSlots);
+		Reset();
+
+		const float* src = vtkFloatArray::SafeDownCast(oldPoints->GetData())->GetPointer(0);
+		float* dst = vtkFloatArray::SafeDownCast(mPoints->GetData())->WritePointer(0, 3 * LivePoints(oldSlots));
+		vtkIdType first = 0;
+		for (Slot slot : oldSlots)
+		{
+			if (slot.removed) continue;
+			std::memcpy(dst + 3 * first, src + 3 * slot.firstPoint, 3 * slot.numPoints * sizeof(float));
+			mIds.resize(slot.numPoints);
+			for (vtkIdType j = 0; j < slot.numPoints; ++j)
+				mIds[j] = first + j;
+			mLines->InsertNextCell(slot.numPoints, mIds.data());
+			mColors->InsertNextTypedTuple(slot.color);
+			slot.firstPoint = first;
+			mCells[slot.id] = (vtkIdType)mSlots.size();
+			mSlots.push_back(slot);
+			mLivePoints += slot.numPoints;
+			first += slot.numPoints;
+		}
+		mColors->Modified();
+		mPolyData->Modified();
+	}
+
+	/// <summary>
+	/// Counts the points of the trajectories that are not removed.
+	/// </summary>
+	static vtkIdType LivePoints(const std::vector<Slot>& slots)
+	{
+		vtkIdType count = 0;
+		for (const Slot& slot : slots)
+			if (!slot.removed) count += slot.numPoints;
+		return count;
+	}
+
+	vtkSmartPointer<vtkPoints> mPoints;					// positions of all trajectories
+	vtkSmartPointer<vtkCellArray> mLines;				// one polyline per trajectory
+	vtkSmartPointer<vtkUnsignedCharArray> mColors;		// RGBA color per trajectory, zero alpha hides it
+	vtkSmartPointer<vtkPolyData> mPolyData;				// geometry of all trajectories
+	vtkSmartPointer<vtkActor> mActor;					// actor that renders all trajectories
+	std::vector<Slot> mSlots;							// trajectory of each cell
+	std::unordered_map<Id, vtkIdType> mCells;			// cell of each trajectory that was not removed
+	std::vector<vtkIdType> mIds;						// scratch buffer for the point ids of a cell
+	Id mNextId = 0;										// handle of the next trajectory
+	vtkIdType mLivePoints = 0;							// points of the trajectories that were not removed
+	vtkIdType mRemovedPoints = 0;						// points of removed trajectories that are still stored
+};
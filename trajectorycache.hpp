@@ -0,0 +1,215 @@
+#pragma once
+
+#include "integrator.hpp"
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/// <summary>
+/// Least recently used cache of computed trajectories and their tubes. Trajectories are keyed by their
+/// quantized initial condition (position, direction of the velocity and Jacobi constant), the integrator
+/// settings and the CRTBP system, so that picks that land on the same spot reuse the earlier result.
+/// The cache evicts the least recently used trajectories once their memory exceeds a cap. It is thread-safe.
+/// </summary>
+class TrajectoryCache
+{
+public:
+	/// <summary>
+	/// Settings of the cache.
+	/// </summary>
+	struct Settings
+	{
+		size_t capacityBytes = 64 << 20;	// memory cap of the stored geometry
+		double positionQuantum = 1e-4;		// initial positions closer than this share a trajectory
+		double angleQuantum = 1e-2;			// quantization of the launch direction in radians, coarser than its change within a position quantum
+		double jacobiQuantum = 1e-6;		// quantization of the Jacobi constant
+	};
+
+	/// <summary>
+	/// Cached trajectory.
+	/// </summary>
+	struct Entry
+	{
+		vtkSmartPointer<vtkPolyData> trajectory;	// integrated centerline with its point attributes
+		vtkSmartPointer<vtkPolyData> tube;			// tube around the decimated centerline
+		double tolerance = 0;						// decimation tolerance of the tube
+	};
+
+	/// <summary>
+	/// Quantized initial condition together with everything else the trajectory depends on.
+	/// </summary>
+	struct Key
+	{
+		int64_t x = 0, y = 0, angle = 0, jacobi = 0;	// quantized initial condition
+		IntegratorType type = IntegratorType::RK4;		// integration scheme
+		double duration = 0, stepSize = 0, outputInterval = 0, relTol = 0, absTol = 0;	// integrator settings
+		double mu = 0, omega = 0;						// CRTBP system
+
+		bool operator==(const Key& other) const
+		{
+			return x == other.x && y == other.y && angle == other.angle && jacobi == other.jacobi && type == other.type
+				&& duration == other.duration && stepSize == other.stepSize && outputInterval == other.outputInterval
+				&& relTol == other.relTol && absTol == other.absTol && mu == other.mu && omega == other.omega;
+		}
+	};
+
+	/// <summary>
+	/// Constructor.
+	/// </summary>
+	explicit TrajectoryCache(const Settings& settings) : mSettings(settings) {}
+
+	/// <summary>
+	/// Builds the key of an initial state in the selected CRTBP system.
+	/// </summary>
+	/// <param name="state">Initial state containing position and velocity.</param>
+	/// <param name="settings">Integrator settings.</param>
+	/// <returns>Key of the trajectory.</returns>
+	Key MakeKey(const Vector4d& state, const IntegratorSettings& settings) const
+	{
+		Vector2d pos(state[0], state[1]), vel(state[2], state[3]);
+		Key key;
+		key.x = Quantize(pos.x(), mSettings.positionQuantum);
+		key.y = Quantize(pos.y(), mSettings.positionQuantum);
+		key.angle = Quantize(std::atan2(vel.y(), vel.x()), mSettings.angleQuantum);
+		key.jacobi = Quantize(2 * CRTBP::PseudoPotential(pos) - vel.squaredNorm(), mSettings.jacobiQuantum);
+		key.type = settings.type;
+		key.duration = settings.duration;
+		key.stepSize = settings.stepSize;
+		if (settings.type == IntegratorType::DormandPrince54)
+		{
+			key.outputInterval = settings.outputInterval;
+			key.relTol = settings.relTol;
+			key.absTol = settings.absTol;
+		}
+		CRTBPSystems::Parameters system = CRTBPSystems::Runtime::Load();
+		key.mu = system.mu;
+		key.omega = system.omega;
+		return key;
+	}
+
+	/// <summary>
+	/// Looks up a trajectory and marks it as most recently used.
+	/// </summary>
+	/// <param name="key">Key of the trajectory.</param>
+	/// <param name="entry">Receives the cached trajectory on a hit.</param>
+	/// <returns>True on a hit.</returns>
+	bool Find(const Key& key, Entry& entry)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mIndex.find(key);
+		if (it == mIndex.end())
+		{
+			mMisses++;
+			return false;
+		}
+		mHits++;
+		mItems.splice(mItems.begin(), mItems, it->second);
+		entry = it->second->entry;
+		return true;
+	}
+
+	/// <summary>
+	/// Stores or replaces a trajectory as most recently used and evicts the least recently used ones that
+	/// exceed the memory cap. A trajectory larger than the cap is not stored.
+	/// </summary>
+	/// <param name="key">Key of the trajectory.</param>
+	/// <param name="entry">Trajectory to store.</param>
+	void Insert(const Key& key, const Entry& entry)
+	{
+		size_t bytes = Bytes(entry.trajectory) + Bytes(entry.tube);
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mIndex.find(key);
+		if (it != mIndex.end())
+		{
+			mBytes -= it->second->bytes;
+			mItems.erase(it->second);
+			mIndex.erase(it);
+		}
+		if (bytes > mSettings.capacityBytes) return;
+
+		mItems.push_front(Item{ key, entry, bytes });
+		mIndex[key] = mItems.begin();
+		mBytes += bytes;
+		while (mBytes > mSettings.capacityBytes)
+		{
+			mBytes -= mItems.back().bytes;
+			mIndex.erase(mItems.back().key);
+			mItems.pop_back();
+		}
+	}
+
+	/// <summary>
+	/// Removes all trajectories. The counters are kept.
+	/// </summary>
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mItems.clear();
+		mIndex.clear();
+		mBytes = 0;
+	}
+
+	uint64_t Hits() const { std::lock_guard<std::mutex> lock(mMutex); return mHits; }				// number of successful lookups
+	uint64_t Misses() const { std::lock_guard<std::mutex> lock(mMutex); return mMisses; }			// number of failed lookups
+	size_t Size() const { std::lock_guard<std::mutex> lock(mMutex); return mItems.size(); }			// number of stored trajectories
+	size_t MemoryBytes() const { std::lock_guard<std::mutex> lock(mMutex); return mBytes; }		// memory of the stored geometry
+
+private:
+	TrajectoryCache(const TrajectoryCache&) = delete;			// Delete the copy-constructor.
+	void operator=(const TrajectoryCache&) = delete;			// Delete the assignment operator.
+
+	/// <summary>
+	/// Stored trajectory together with its key and size.
+	/// </summary>
+	struct Item
+	{
+		Key key;
+		Entry entry;
+		size_t bytes;
+	};
+
+	/// <summary>
+	/// Hash of a key.
+	/// </summary>
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const
+		{
+			size_t h = 0;
+			auto combine = [&](size_t v) { h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2); };
+			combine(std::hash<int64_t>()(key.x));
+			combine(std::hash<int64_t>()(key.y));
+			combine(std::hash<int64_t>()(key.angle));
+			combine(std::hash<int64_t>()(key.jacobi));
+			combine(std::hash<int>()((int)key.type));
+			for (double v : { key.duration, key.stepSize, key.outputInterval, key.relTol, key.absTol, key.mu, key.omega })
+				combine(std::hash<double>()(v));
+			return h;
+		}
+	};
+
+	/// <summary>
+	/// Rounds a value to the nearest multiple of a quantum.
+	/// </summary>
+	static int64_t Quantize(double value, double quantum) { return (int64_t)std::llround(value / quantum); }
+
+	/// <summary>
+	/// Gets the memory of a polydata in bytes.
+	/// </summary>
+	static size_t Bytes(vtkPolyData* polyData) { return polyData ? (size_t)polyData->GetActualMemorySize() * 1024 : 0; }
+
+	Settings mSettings;																// cap and quantization
+	mutable std::mutex mMutex;														// guards all members below
+	std::list<Item> mItems;															// trajectories, most recently used first
+	std::unordered_map<Key, std::list<Item>::iterator, KeyHash> mIndex;				// position of each key in mItems
+	size_t mBytes = 0;																// memory of the stored geometry
+	uint64_t mHits = 0;																// number of successful lookups
+	uint64_t mMisses = 0;															// number of failed lookups
+};
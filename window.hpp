@@ -31,6 +31,68 @@ public:
 		mScene->Pick(world);
 	}
 
+	/// <summary>
+	/// Responds when the mouse moves: previews the trajectory under the cursor unless the camera is being moved.
+	/// </summary>
+	virtual void OnMouseMove() override {
+		vtkInteractorStyleTerrain::OnMouseMove();
+		if (this->GetState() == VTKIS_NONE)
+			mScene->Hover(PickPlane());
+	}
+
+	/// <summary>
+	/// Responds to key presses, other keys keep their terrain style bindings:
+	/// 'n' switches to the next CRTBP system, 'i' toggles between fixed step and adaptive integration,
+	/// 'b' integrates a benchmark ensemble around the last pick, 'o' computes the Poincare section y = 0,
+	/// 'g' computes or toggles the FTLE field, 'h' toggles the trajectory preview under the cursor,
+	/// 'k' toggles the streaming mode of the tracer, 'a' starts or pauses the particle animation,
+	/// 'x' and 'y' compute the Lyapunov orbit family around L1 and L2, 'v' computes the manifolds of a family orbit,
+	/// 'c' searches connections between the manifolds of the last two orbits.
+	/// </summary>
+	virtual void OnChar() override {
+		switch (this->GetInteractor()->GetKeyCode()) {
+		case 'n':
+			mScene->NextSystem();
+			break;
+		case 'i':
+			mScene->ToggleIntegrator();
+			break;
+		case 'b':
+			mScene->RunEnsemble();
+			break;
+		case 'o':
+			mScene->StartPoincareSection();
+			break;
+		case 'g':
+			mScene->ToggleFTLE();
+			break;
+		case 'h':
+			mScene->TogglePreview();
+			break;
+		case 'k':
+			mScene->ToggleStreaming();
+			break;
+		case 'a':
+			mScene->ToggleParticles();
+			break;
+		case 'x':
+			mScene->ComputeFamily(0);
+			break;
+		case 'y':
+			mScene->ComputeFamily(1);
+			break;
+		case 'v':
+			mScene->ComputeManifolds();
+			break;
+		case 'c':
+			mScene->FindConnections();
+			break;
+		default:
+			vtkInteractorStyleTerrain::OnChar();
+			break;
+		}
+	}
+
 	/// <summary>
 	/// Sets the scene that the picking is forwarded to.
 	/// </summary>